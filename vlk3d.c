@@ -4,19 +4,30 @@
 #include <float.h>
 #include <time.h>
 #include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <SDL2/SDL_mixer.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_PACKET_RAYCASTER 1
+#endif
+
 /* Constants */
 
 #define WINDOW_WIDTH 1366
 #define WINDOW_HEIGHT 768
 
 #define FOV (M_PI / 3.0)
-#define RAY_COUNT WINDOW_WIDTH
-#define RAY_STEP 0.01
 #define MAX_DISTANCE 20.0
 
 /* Types/typedefs */
@@ -34,9 +45,17 @@ typedef struct {
 
 typedef enum {
     GAME_RESULT_WIN,
-    GAME_RESULT_ABORT
+    GAME_RESULT_ABORT,
+    GAME_RESULT_BENCH_DONE
 } game_result_t;
 
+/* Frames are either drawn by the SDL renderer directly, or rasterized on the
+ * CPU into a framebuffer uploaded once per frame */
+typedef enum {
+    RENDER_BACKEND_SDL,
+    RENDER_BACKEND_SOFTWARE
+} render_backend_t;
+
 /* wall collision check result enum, should be 0 for no collision, other values
  * for horizontal/vertical hit */
 typedef enum {
@@ -45,36 +64,424 @@ typedef enum {
     HIT_VERTICAL,
 } wall_collision_result_t;
 
-#define PLAYER_ROTATION_SPEED 0.05
-#define PLAYER_MOVEMENT_SPEED 0.1
+/* Where a ray cast for a screen column stopped */
+typedef struct {
+    float distance;
+    float tex_offset;
+    Uint8 texture;              /* index into wall_textures */
+    wall_collision_result_t collision;
+} RayHit;
+
+/* Rays are cast one by one or in SIMD packets of adjacent rays, auto picks
+ * the widest packets supported by the CPU */
+typedef enum {
+    RAYCASTER_AUTO,
+    RAYCASTER_SCALAR,
+    RAYCASTER_SSE2,
+    RAYCASTER_AVX2
+} raycaster_t;
+
+/* per millisecond of simulated time */
+#define PLAYER_ROTATION_SPEED 0.003f
+#define PLAYER_MOVEMENT_SPEED 0.003f
 
 #define PROJECTILE_SPEED 0.003f
 
 TTF_Font *font = NULL;
 
+/* Printable ASCII glyphs of the font, rasterized once into a texture atlas */
+#define GLYPH_FIRST ' '
+#define GLYPH_LAST '~'
+#define GLYPH_COUNT (GLYPH_LAST - GLYPH_FIRST + 1)
+#define GLYPH_ATLAS_WIDTH 1024
+
+typedef struct {
+    SDL_Rect rect;              /* in the atlas */
+    int advance;
+} Glyph;
+
+struct {
+    SDL_Texture *texture;
+    Glyph glyphs[GLYPH_COUNT];
+    int height;
+} glyph_atlas = {0};
+
+/* A string laid out as glyph quads, relative to its top left corner. Quads
+ * are only recomputed when the string changes. */
+#define TEXT_MAX_LENGTH 64
+
+typedef struct {
+    char content[TEXT_MAX_LENGTH];
+    bool is_laid_out;
+    SDL_Rect src[TEXT_MAX_LENGTH];
+    SDL_Rect dest[TEXT_MAX_LENGTH];
+    int num_quads;
+    int width;
+    int height;
+} Text;
+
+Text coin_text, todo_text;
+
 Mix_Chunk *door_sound = NULL;
 Mix_Chunk *pain_sound = NULL;
 Mix_Chunk *brush_sound = NULL;
 
-int line_height_buffer[RAY_COUNT] = {0};
+/* The scene (walls, floors and sprites) is rendered at an internal
+ * resolution of its own, a fraction of the window, and scaled up to the
+ * window at present. The HUD is drawn over it at window resolution. With an
+ * automatic scale, adjust_view_scale trades resolution for frame time. */
+#define MIN_VIEW_SCALE 0.25f
+#define VIEW_SCALE_STEP 0.05f
+
+/* frames between two automatic scale changes, to let the frame time settle */
+#define VIEW_SCALE_COOLDOWN 30
+
+struct {
+    float scale;                /* of the window size */
+    bool is_auto;
+    float budget;               /* milliseconds of rendering per frame */
+    float frame_time;           /* moving average of rendering, milliseconds */
+    int cooldown;
+
+    int width;                  /* also the number of rays, one per column */
+    int height;
+    SDL_Texture *texture;       /* render target of the SDL backend */
+} view = {.scale = 1.0f};
+
+/* Per-column buffers, view.width long */
+int *line_height_buffer = NULL;
+RayHit *ray_hits = NULL;
+
+/* Coarse depth buffer: the shortest wall line height of every block of
+ * DEPTH_BLOCK_WIDTH columns, built after the wall pass. A sprite shorter than
+ * that across all the blocks it overlaps is behind the walls in every one of
+ * its columns. */
+#define DEPTH_BLOCK_WIDTH 16
+
+int *depth_blocks = NULL;       /* view.width / DEPTH_BLOCK_WIDTH, rounded up */
+
+/* The view is the player direction rotated by a fixed angle per column, so
+ * the per-column rotations only depend on FOV and the view width and are
+ * built along with the view (see build_camera_tables). Each frame then only needs the player
+ * direction as a vector (see update_camera). */
+struct {
+    /* the player as drawn: interpolated between the last two simulation
+     * ticks, alpha of the way from the previous one */
+    float x;
+    float y;
+    float alpha;
+    Vector2 direction;
+    /* distance to the projection plane in pixels, for sprites */
+    float projection;
+    float tan_half_fov;
+
+    /* per-column ray rotation relative to the view direction, the cosine
+     * doubles as the fisheye correction factor */
+    float *column_cos;
+    float *column_sin;
+    float *column_tan;
+} camera;
+
+raycaster_t raycaster = RAYCASTER_AUTO;
+const char *raycaster_names[] = {
+    [RAYCASTER_AUTO] = "auto",
+    [RAYCASTER_SCALAR] = "scalar",
+    [RAYCASTER_SSE2] = "sse2",
+    [RAYCASTER_AVX2] = "avx2"
+};
+
+/* Diff every packet cast ray against the scalar ray caster */
+bool raycaster_check = false;
+
+/* Check the objects queried around the field of view against all of them */
+bool cull_check = false;
+
+/* Texture floors and ceilings in the software backend instead of filling
+ * them with flat colors */
+bool textured_flats = false;
+
+const char *map_filename = "assets/map.txt";
+
+/* Compile the map into the binary format instead of running the game */
+const char *map_output_filename = NULL;
+
+/* Verify the checksum of compiled maps on load, cells are always checked */
+bool map_check = false;
+
+/* The simulation advances in fixed ticks whatever the frame rate, frames
+ * are drawn with the state interpolated between the last two ticks. Frames
+ * are paced by sleeping until the next frame is due, by waiting for vsync in
+ * SDL_RenderPresent, or not at all. */
+typedef enum {
+    PACING_SLEEP,
+    PACING_VSYNC,
+    PACING_NONE
+} pacing_t;
+
+const char *pacing_names[] = {
+    [PACING_SLEEP] = "sleep",
+    [PACING_VSYNC] = "vsync",
+    [PACING_NONE] = "none"
+};
+
+/* After a stall the simulation skips time rather than trying to catch up
+ * with more than this many ticks in one frame */
+#define MAX_TICKS_PER_FRAME 8
+
+struct {
+    int tick_rate;              /* ticks per second */
+    int frame_rate;             /* frames per second when sleeping */
+    pacing_t pacing;
+
+    /* in performance counter units */
+    Uint64 tick_duration;
+    Uint64 frame_duration;
+    Uint64 next_frame;
+} timing = {.tick_rate = 60, .frame_rate = 60, .pacing = PACING_SLEEP};
+
+/* Held keys, sampled once per simulation tick, and whether the brush was
+ * thrown since the last tick */
+typedef struct {
+    bool forward;
+    bool backward;
+    bool turn_left;
+    bool turn_right;
+    bool fire;
+} Input;
+
+/* Input to present latency: from the SDL event timestamp of a movement key
+ * press to the present of the first frame drawn after a tick applied it */
+#define INPUT_LATENCY_SAMPLES 1024
+
+struct {
+    Input current;
+    bool is_fire_requested;
+    bool is_reported;
+
+    bool is_press_pending;      /* not seen by a tick yet */
+    bool is_press_applied;      /* seen by a tick, not presented yet */
+    Uint32 press_time;          /* SDL_GetTicks milliseconds */
+
+    float latencies[INPUT_LATENCY_SAMPLES];
+    int num_latencies;          /* ever recorded, wraps around */
+} input = {0};
+
+/* Randomness of the simulation comes from this generator only (xorshift64*),
+ * so a run is reproduced by its seed and its input */
+struct {
+    Uint64 seed;
+    bool is_seeded;             /* by --seed, otherwise by the clock */
+    Uint64 state;
+} rng = {0};
+
+/* Recorded runs: the seed, the tick rate and every tick's input plus a hash
+ * of the simulation state after it. Replays run headless through the
+ * benchmark, one tick per frame, and check the hashes as they go. The file
+ * is a header followed by 5 bytes per tick (input bits and the low half of
+ * the state hash) in the byte order of the machine that recorded it. */
+#define REPLAY_MAGIC "VLK3DREC"
+#define REPLAY_VERSION 1
+
+#define REPLAY_INPUT_FORWARD (1 << 0)
+#define REPLAY_INPUT_BACKWARD (1 << 1)
+#define REPLAY_INPUT_TURN_LEFT (1 << 2)
+#define REPLAY_INPUT_TURN_RIGHT (1 << 3)
+#define REPLAY_INPUT_FIRE (1 << 4)
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 tick_rate;
+    Uint64 seed;
+    Uint32 num_ticks;
+    Uint32 reserved;
+    Uint64 initial_hash;        /* the state of the level as loaded */
+} ReplayHeader;
+
+struct {
+    const char *filename;
+    bool is_recording;
+    bool is_replaying;
+    FILE *file;
+
+    ReplayHeader header;
+    Uint32 tick;
+    Sint64 mismatch_tick;       /* the first tick that diverged, -1 if none */
+} replay = {.mismatch_tick = -1};
+
+/* Benchmark mode: the player follows a scripted camera path with one
+ * simulation tick per frame and no frame pacing, frame times of the game loop
+ * stages are reported as JSON when the path is over */
+
+typedef struct {
+    float x, y;
+    float direction;
+    int frames;
+} BenchKeyframe;
+
+typedef enum {
+    BENCH_STAGE_UPDATE,
+    BENCH_STAGE_WALLS,
+    BENCH_STAGE_SPRITES,
+    BENCH_STAGE_UI,
+    BENCH_STAGE_PRESENT,
+    BENCH_STAGE_FRAME,
+    BENCH_STAGE_COUNT
+} bench_stage_t;
+
+const char *bench_stage_names[] = {
+    [BENCH_STAGE_UPDATE] = "update_objects",
+    [BENCH_STAGE_WALLS] = "render_walls",
+    [BENCH_STAGE_SPRITES] = "render_sprites",
+    [BENCH_STAGE_UI] = "render_ui",
+    [BENCH_STAGE_PRESENT] = "present",
+    [BENCH_STAGE_FRAME] = "frame"
+};
+
+struct {
+    bool is_enabled;
+    const char *path_filename;
+
+    BenchKeyframe *keyframes;
+    int num_keyframes;
+    int num_frames;
+
+    /* milliseconds spent in every stage of every frame */
+    int frame;
+    float *stage_times[BENCH_STAGE_COUNT];
+} bench = {0};
+
+render_backend_t render_backend = RENDER_BACKEND_SDL;
+
+/* CPU-side frame for the software backend and the streaming texture it gets
+ * uploaded to */
+Uint32 *framebuffer = NULL;
+SDL_Texture *framebuffer_texture = NULL;
+
+/* Software frames are split into column strips rendered in parallel by a
+ * persistent pool of worker threads, the main thread takes strips as well */
+#define MAX_RENDER_THREADS 64
+#define RENDER_STRIPS_PER_THREAD 4
+
+typedef void (*render_strip_fn)(int col_start, int col_end);
+
+struct {
+    int num_threads;            /* 0 means the number of CPUs */
+    int num_workers;
+    SDL_Thread *workers[MAX_RENDER_THREADS];
+    SDL_sem *start[MAX_RENDER_THREADS];
+    SDL_sem *done;
+    bool is_quitting;
+
+    /* the job being run: strips are picked by workers one by one until all
+     * of the columns are drawn */
+    render_strip_fn render_strip;
+    int num_strips;
+    int strip_width;
+    SDL_atomic_t next_strip;
+} render_pool = {0};
+
+/* Frame profiler: nested zones are recorded with their timestamps into a ring
+ * buffer per thread. Only the owning thread writes to a ring, so there is no
+ * locking; the rings are read by the main thread between frames. */
+#define PROFILE_RING_SIZE (1 << 16) /* zones, a power of two */
+#define PROFILE_MAX_DEPTH 16
+#define PROFILE_OVERLAY_FRAMES 120
+
+typedef struct {
+    const char *name;
+    Uint64 start;
+    Uint64 end;                 /* 0 while the zone is open */
+    Uint32 frame;
+    int depth;
+} ProfileZone;
+
+typedef struct {
+    ProfileZone *zones;
+    Uint32 num_zones;           /* zones ever recorded, wraps around the ring */
+    int depth;
+    Uint32 open_zones[PROFILE_MAX_DEPTH];
+} ProfileRing;
+
+/* Game loop stages in the overlay, the last one collects anything else */
+typedef struct {
+    const char *name;
+    SDL_Color color;
+} ProfileStage;
+
+#define PROFILE_STAGE_COUNT 9
+
+const ProfileStage profile_stages[PROFILE_STAGE_COUNT] = {
+    {"handle_events", {128, 128, 128, 255}},
+    {"update_objects", {255, 200, 0, 255}},
+    {"render_walls", {0, 160, 255, 255}},
+    {"render_sprites", {0, 220, 100, 255}},
+    {"upload_framebuffer", {160, 80, 255, 255}},
+    {"present_view", {0, 200, 200, 255}},
+    {"render_ui", {255, 120, 200, 255}},
+    {"present", {255, 255, 255, 255}},
+    {"other", {80, 80, 80, 255}}
+};
+
+struct {
+    bool is_enabled;
+    bool is_overlay_visible;
+    const char *trace_filename;
+
+    Uint64 start_time;
+    Uint32 frame;
+    int num_threads;
+    ProfileRing rings[MAX_RENDER_THREADS];
+    SDL_Texture *stage_labels[PROFILE_STAGE_COUNT];
+} profiler = {0};
+
+/* Index of the profiler ring of the current thread: 0 is the main thread,
+ * render workers follow */
+_Thread_local int profile_thread = 0;
 
 #define TEXTURE_WIDTH 128
 #define TEXTURE_HEIGHT 128
 
-SDL_Texture *wall_texture = NULL;
-SDL_Texture *wall_window_texture = NULL;
-SDL_Texture *wall_painting_texture = NULL;
-SDL_Texture *wall_door_texture = NULL;
-SDL_Texture *wall_picture_texture = NULL;
-SDL_Texture *fly_texture = NULL;
-SDL_Texture *poo_texture = NULL;
-SDL_Texture *brush_texture = NULL;
-SDL_Texture *flower_unwatered_texture = NULL;
-SDL_Texture *flower_watered_texture = NULL;
-SDL_Texture *coin_texture = NULL;
+/* A texture as placed in the texture atlas of the renderer plus decoded
+ * texels for the software backend. Walls and sprites are drawn one vertical
+ * column at a time, so the texels are stored transposed (ARGB8888,
+ * column-major): a column is height consecutive texels.
+ *
+ * Every texture has a mip chain: levels[0] is the texture itself, each next
+ * level is half as wide and high down to a single texel. Distant walls and
+ * sprites are drawn from smaller levels (see mip_level), which alias less and
+ * touch fewer texels. */
+#define MAX_MIP_LEVELS 12
+
+typedef struct Texture Texture;
+struct Texture {
+    SDL_FRect atlas_rect;       /* texture coordinates in the atlas */
+    Uint32 *pixels;
+    int width;
+    int height;
+
+    int num_levels;
+    Texture *levels;
+};
+
+Texture wall_texture;
+Texture wall_window_texture;
+Texture wall_painting_texture;
+Texture wall_door_texture;
+Texture wall_picture_texture;
+Texture fly_texture;
+Texture poo_texture;
+Texture brush_texture;
+Texture flower_unwatered_texture;
+Texture flower_watered_texture;
+Texture coin_texture;
+Texture floor_texture;
+Texture floor_wood_texture;
+Texture ceiling_texture;
+Texture ceiling_panels_texture;
 
 struct {
-    SDL_Texture **texture;
+    Texture *texture;
     char *name;
 } name_to_texture_table[] = {
     { &wall_texture, "assets/wall.png"},
@@ -88,51 +495,239 @@ struct {
     { &flower_unwatered_texture, "assets/flower_unwatered.png"},
     { &flower_watered_texture, "assets/flower_watered.png"},
     { &coin_texture, "assets/coin.png"},
+    { &floor_texture, "assets/floor.png"},
+    { &floor_wood_texture, "assets/floor_wood.png"},
+    { &ceiling_texture, "assets/ceiling.png"},
+    { &ceiling_panels_texture, "assets/ceiling_panels.png"},
 };
 
-SDL_Texture **char_to_texture_table[] = {
-    ['1'] = &wall_texture,
-    ['2'] = &wall_window_texture,
-    ['3'] = &wall_painting_texture,
-    ['4'] = &wall_picture_texture,
-    ['-'] = &wall_door_texture,
-    ['|'] = &wall_door_texture
+/* Every level of every texture packed into a single renderer texture, so
+ * that the SDL backend draws a whole pass without switching textures */
+#define TEXTURE_ATLAS_WIDTH 1024
+#define TEXTURE_ATLAS_PADDING 1
+
+struct {
+    SDL_Texture *texture;
+    SDL_FRect white;            /* an opaque white texel for solid quads */
+} texture_atlas = {0};
+
+/* Textures of walls and doors, as referenced by map cells */
+typedef enum {
+    WALL_TEXTURE_WALL,
+    WALL_TEXTURE_WINDOW,
+    WALL_TEXTURE_PAINTING,
+    WALL_TEXTURE_PICTURE,
+    WALL_TEXTURE_DOOR,
+    WALL_TEXTURE_COUNT
+} wall_texture_t;
+
+Texture *wall_textures[WALL_TEXTURE_COUNT] = {
+    [WALL_TEXTURE_WALL] = &wall_texture,
+    [WALL_TEXTURE_WINDOW] = &wall_window_texture,
+    [WALL_TEXTURE_PAINTING] = &wall_painting_texture,
+    [WALL_TEXTURE_PICTURE] = &wall_picture_texture,
+    [WALL_TEXTURE_DOOR] = &wall_door_texture
+};
+
+/* Textures of floors and ceilings, as referenced by map cells and chosen by
+ * digit in the flat layers of text maps. Any of them can go on either layer.
+ * They wrap around once per tile and must be TEXTURE_WIDTH x TEXTURE_HEIGHT,
+ * with TEXTURE_WIDTH = 1 << FLAT_TEXTURE_SHIFT. */
+#define FLAT_TEXTURE_SHIFT 7
+
+typedef enum {
+    FLAT_TEXTURE_FLOOR,
+    FLAT_TEXTURE_CEILING,
+    FLAT_TEXTURE_WOOD,
+    FLAT_TEXTURE_PANELS,
+    FLAT_TEXTURE_COUNT
+} flat_texture_t;
+
+Texture *flat_textures[FLAT_TEXTURE_COUNT] = {
+    [FLAT_TEXTURE_FLOOR] = &floor_texture,
+    [FLAT_TEXTURE_CEILING] = &ceiling_texture,
+    [FLAT_TEXTURE_WOOD] = &floor_wood_texture,
+    [FLAT_TEXTURE_PANELS] = &ceiling_panels_texture
 };
 
+/* The flat textures of each mip level back to back, so that the texel of any
+ * cell is an offset from one base: texel u, v of flat texture t is at
+ * t << 2 * shift | u << shift | v, where shift = FLAT_TEXTURE_SHIFT - level */
+struct {
+    Uint32 *levels[MAX_MIP_LEVELS];
+    int num_levels;
+} flat_texels = {0};
+
 /* Game state */
 
-/* Tile map */
-char **map;
+/* Tile map, compiled from the map file into one flat array of cells with a
+ * solid border of sentinel cells around it, so that a grid walk leaving the
+ * map stops at the border without any bounds checks. Positions looked up must
+ * be at most one tile away from the map. */
+#define CELL_SOLID (1 << 0)
+#define CELL_DOOR (1 << 1)
+#define CELL_HORIZONTAL (1 << 2)    /* door plane along the x axis ('-') */
+
+/* Cells are stored in compiled maps as is, so the layout is fixed */
+typedef struct {
+    Uint8 flags;
+    Uint8 texture;              /* index into wall_textures */
+    Uint8 floor;                /* index into flat_textures */
+    Uint8 ceiling;              /* index into flat_textures */
+    Sint32 door;                /* index into the door table, -1 if none */
+} Cell;
+
+struct {
+    Cell *cells;                /* (map_width + 2) x (map_height + 2) */
+    Cell *origin;               /* the cell at 0, 0 */
+    int stride;
+} tile_grid = {0};
+
 int map_width;
 int map_height;
 
+/* A door of the door table, ordered as on the map */
+typedef struct {
+    Sint32 x;
+    Sint32 y;
+} MapDoor;
+
+/* Anything else placed on the map, i.e. the player start ('@') and objects,
+ * by their map character, ordered as on the map */
+typedef struct {
+    Sint32 x;
+    Sint32 y;
+    Uint8 type;
+    Uint8 reserved[3];
+} MapSpawn;
+
+/* Fog of a map: texels fade into the fog color from the start distance on
+ * and are fully fogged at the end distance. No fog if the end is 0. */
+typedef struct {
+    Uint8 color[4];             /* r, g, b, unused */
+    float start;
+    float end;
+} MapFog;
+
+/* Compiled map file: the header is followed by the cells (with the border),
+ * the door table and the spawn list, each starting at an 8 byte aligned
+ * offset. Numbers are in the byte order of the machine that compiled it, the
+ * checksum is FNV-1a over everything after the header. */
+#define MAP_MAGIC "VLK3DMAP"
+#define MAP_VERSION 3
+#define MAP_BYTE_ORDER 0x01020304
+#define MAP_MAX_SIDE (1 << 15)
+
+typedef struct {
+    char magic[8];
+    Uint32 version;
+    Uint32 byte_order;
+    Sint32 width;
+    Sint32 height;
+    Uint32 num_doors;
+    Uint32 num_spawns;
+    MapFog fog;
+    Uint32 reserved;
+    Uint64 cells_offset;
+    Uint64 doors_offset;
+    Uint64 spawns_offset;
+    Uint64 file_size;
+    Uint64 checksum;
+} MapHeader;
+
+/* The parts of the level besides the tile grid: either in the level arena or
+ * pointing into the memory mapped compiled map */
+struct {
+    MapDoor *doors;
+    int num_doors;
+    MapSpawn *spawns;
+    int num_spawns;
+    int *door_objects;          /* the object of each door */
+    MapFog fog;
+    void *mapping;              /* the compiled map, NULL for text maps */
+    size_t mapping_size;
+} level = {0};
+
+/* Lighting: texels are shaded by the face they are on and faded into the fog
+ * of the map with distance. Faces and quantized distances make up light
+ * levels, each with a lookup table per color channel, so that shading a texel
+ * takes three table lookups. The tables are built once per map, see
+ * build_light_tables. */
+#define LIGHT_DISTANCE_STEPS 64
+
+typedef struct {
+    Uint8 channels[3][256];     /* r, g, b */
+
+    /* the same light for the SDL renderer, which can only multiply texels by
+     * a color: the fog is approximated by tinting towards its color */
+    SDL_Color modulation;
+} LightLevel;
+
+struct {
+    /* by face, i.e. the wall_collision_result_t of wall hits (HIT_NONE for
+     * sprites, floors and ceilings), and by distance */
+    LightLevel levels[3][LIGHT_DISTANCE_STEPS];
+
+    /* the lit floor or ceiling color of every view row */
+    Uint32 *row_colors;
+} lighting;
+
+/* A floor or ceiling row of the software backend. Every row is at a fixed
+ * distance, so the texel coordinates under column x step linearly with the
+ * column tangent: u + column_tan[x] * du, v + column_tan[x] * dv, in texels
+ * of the mip level of the row, 1 << shift of them per tile. */
+typedef struct {
+    float u;
+    float v;
+    float du;
+    float dv;
+    int shift;
+    int layer;                  /* offset of floor or ceiling in Cell */
+    const Uint32 *pixels;       /* the mip level in flat_texels */
+    const LightLevel *light;
+} FlatRow;
+
 Player player = {0, 0, 0};
+
+/* the player as of the previous simulation tick, for interpolation */
+Player previous_player = {0, 0, 0};
 int coins_collected = 0;
 int todo_left = 0;
 
 #define ENEMY_PROXIMITY_DISTANCE 0.5
 
-/* Objects are actionable non-wall entities.  */
-typedef struct Object Object;
-struct Object {
-    SDL_Texture *texture;
-    float x, y;
-    Vector2 direction;
-    float hit_distance;
-    float touch_distance;
-
-    bool is_updateable;
-    bool is_hittable;
-    bool is_visible;
-    bool is_harmless;
-    bool is_touchable;
-
-    void (*update) (Object *Object, Uint32 elapsed_time);
-    void (*hit) (Object *Object);
-    void (*touch) (Object *Object);
+/* Objects are actionable non-wall entities. They are stored as parallel
+ * arrays indexed by object: the fields every pass over the objects reads
+ * (positions, flags, radii, kind) are kept apart from the cold per-kind state
+ * that only the callbacks of an object touch. */
+typedef enum {
+    OBJECT_PROJECTILE,
+    OBJECT_POO,
+    OBJECT_FLY,
+    OBJECT_FLOWER,
+    OBJECT_COIN,
+    OBJECT_DOOR,
+    OBJECT_FREE,                /* in the free list of the pool */
+    OBJECT_KIND_COUNT
+} object_kind_t;
+
+/* Object flags */
+#define OBJECT_UPDATEABLE (1 << 0)
+#define OBJECT_HITTABLE (1 << 1)
+#define OBJECT_VISIBLE (1 << 2)
+#define OBJECT_HARMLESS (1 << 3)
+#define OBJECT_TOUCHABLE (1 << 4)
+
+/* Callbacks shared by all of the objects of a kind */
+typedef struct {
+    void (*update) (int object, float elapsed_time);
+    void (*hit) (int object);
+    void (*touch) (int object);
+} ObjectKind;
 
-    float distance_to_player;
-    float angle_to_player;
+typedef struct {
+    Texture *texture;
+    Vector2 direction;
 
     union {
         struct {
@@ -141,21 +736,117 @@ struct Object {
             float door_width;
         } door;
         struct {
-            SDL_Texture *texture_watered;
+            Texture *texture_watered;
             bool is_watered;
         } flower;
     } as;
+} ObjectState;
+
+/* Level memory: a chain of blocks handed out by bumping an offset, all of it
+ * released at once when the level is unloaded */
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
 };
 
-#define MAX_OBJECTS 50
-Object objects[MAX_OBJECTS];
+typedef struct {
+    ArenaBlock *blocks;
+} Arena;
+
+/* Owns the tile grid (unless memory mapped), the door table, the object grid
+ * and the object pool of the current level */
+Arena level_arena = {0};
+
+/* The object pool: arrays grow in the level arena, destroyed objects are
+ * linked into a free list through grid_next and reused first */
+struct {
+    int capacity;
+    int free_list;              /* -1 if empty */
+
+    /* hot */
+    float *x;
+    float *y;
+    float *prev_x;              /* as of the previous simulation tick */
+    float *prev_y;
+    Uint8 *flags;
+    Uint8 *kind;
+    float *hit_distance;
+    float *touch_distance;
+
+    /* links in the object grid bucket of the tile the object is in */
+    int *grid_cell;
+    int *grid_prev;
+    int *grid_next;
+
+    /* cold */
+    ObjectState *state;
+
+    /* room for query results over every object */
+    int *nearby;
+} objects = {.free_list = -1};
+
+/* objects in use, including the free ones */
 int num_objects = 0;
 
+/* A visible object relative to the player: distance, depth along the view
+ * direction and offset across it */
+typedef struct {
+    Texture *texture;
+    float distance_to_player;
+    float view_depth;
+    float view_offset;
+} VisibleObject;
+
+/* as big as the object pool */
+VisibleObject *objects_visible = NULL;
 
-/* A map of doors in the game. Each float is a state of the door, i.e. the
- * door_width "persentage" use to either draw door column upon ray hit, or just
- * ignore it */
-Object ***door_map;
+
+/* Spatial index over the objects, one bucket per map tile */
+struct {
+    int *cells;                 /* first object in every tile, -1 if none */
+} object_grid = {0};
+
+/* Rooms: the open tiles of the map split into 4-connected areas, separated
+ * by walls and doors. Every door is a portal between the rooms on either side
+ * of it. Each frame visibility floods from the room of the camera through the
+ * portals that are not fully closed and overlap the field of view (see
+ * update_room_visibility), objects in the rooms it does not reach are not
+ * drawn. Everything lives in the level arena. */
+typedef struct {
+    int door;                   /* index into the door table */
+    int rooms[2];               /* on either side, -1 if none */
+} Portal;
+
+struct {
+    int *tile_rooms;            /* of every tile, -1 for walls and doors */
+    int num_rooms;
+
+    Portal *portals;            /* one per door */
+    int *room_portals;          /* the portals of every room, ... */
+    int *first_portal;          /* ... room r owning [first_portal[r], first_portal[r + 1]) */
+
+    Uint8 *is_visible;          /* by room, this frame */
+    int *stack;                 /* rooms left to flood from */
+} rooms = {0};
+
+/* Objects only touch or get hit within this distance */
+#define MAX_INTERACTION_DISTANCE 1.0f
+
+
+/* Quads for the SDL renderer are queued up for a whole pass and drawn from
+ * the texture atlas with a single SDL_RenderGeometry call, shaded by their
+ * vertex colors. The buffers grow as needed and are reused across frames. */
+struct {
+    int num_quads;
+    int max_quads;
+    SDL_Vertex *vertices;
+    int *indices;
+} batch = {0};
 
 
 /* Function prototypes */
@@ -164,78 +855,236 @@ game_result_t game_loop(void);
 
 void handle_events(SDL_Event *event, bool *is_running);
 void render_walls();
-float cast_ray(float angle, char *wall_type, float *tex_offset, wall_collision_result_t *collision_res);
-bool is_wall(int x, int y);
-bool is_within_bounds(int x, int y) ;
+void build_camera_tables(void);
+void update_camera(float alpha);
+Vector2 ray_direction(int col);
+void cast_rays(int col_start, int col_end);
+void cast_ray(Vector2 direction, RayHit *hit);
+bool is_ray_hit(int map_x, int map_y, Vector2 direction, float distance, wall_collision_result_t side, RayHit *hit);
+#ifdef HAVE_PACKET_RAYCASTER
+void cast_ray_packet_sse2(int col, RayHit *hits);
+void cast_ray_packet_avx2(int col, RayHit *hits);
+#endif
+void init_raycaster(void);
+Cell *map_cell(int map_x, int map_y);
 bool is_move_collision(float x, float y);
-bool is_door_collision(float x, float y, char *wall_type, float *tex_offset, bool check_if_open);
-wall_collision_result_t is_wall_collision(float x, float y, char *wall_type, float *tex_offset);
+bool is_door_ray_collision(int map_x, int map_y, const Cell *cell, Vector2 direction, float *distance, float *tex_offset);
+bool is_door_collision(float x, float y, float *tex_offset, bool check_if_open);
+wall_collision_result_t is_wall_collision(float x, float y, float *tex_offset);
 bool is_horizontal_wall(Vector2 position);
 bool has_no_things_to_do();
 
-void init_poo(Object *object, int x, int y);
-void poo_hit(Object *object);
-void poo_touch(Object *object);
-
-void init_fly(Object *object, int x, int y);
-void fly_hit(Object *object);
-void fly_update(Object *object, Uint32 elapsed_time);
-void fly_touch(Object *object);
-
-void init_flower(Object *object, int x, int y);
-void touch_flower(Object *object);
-
-void init_coin(Object *object, int x, int y);
-void touch_coin(Object *object);
-
-void init_projectile(Object *object);
-void projectile_update(Object *object, Uint32 elapsed_time);
-
-void init_door(Object *object, int x, int y);
-void door_hit(Object *object);
-void door_update(Object *object, Uint32 elapsed_time);
-
-void update_objects(Uint32 elapsed_time);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_release(Arena *arena);
+
+void init_object(int object, object_kind_t kind, float x, float y, Uint8 flags, Texture *texture);
+void grow_objects(int capacity);
+int create_object(void);
+void destroy_object(int object);
+
+void init_poo(int object, int x, int y);
+void poo_hit(int object);
+void poo_touch(int object);
+
+void init_fly(int object, int x, int y);
+void fly_hit(int object);
+void fly_update(int object, float elapsed_time);
+void fly_touch(int object);
+
+void init_flower(int object, int x, int y);
+void touch_flower(int object);
+
+void init_coin(int object, int x, int y);
+void touch_coin(int object);
+
+void init_projectile(int object);
+void projectile_update(int object, float elapsed_time);
+
+void init_door(int object, int x, int y);
+void door_hit(int object);
+void door_update(int object, float elapsed_time);
+
+void update_objects(float elapsed_time);
+
+void load_object_grid(void);
+void object_grid_insert(int object);
+void object_grid_remove(int object);
+void move_object(int object, float x, float y);
+int query_objects_in_box(float min_x, float min_y, float max_x, float max_y, int *result, int max_results);
+int query_objects_in_range(float x, float y, float radius, int *result, int max_results);
+int query_objects_along_ray(float x0, float y0, float x1, float y1, float radius, int *result, int max_results);
+int query_objects_in_view(int *result, int max_results);
+bool is_object_in_view(int object, float *dx, float *dy, float *view_depth, float *view_offset);
+void check_objects_in_view(const int *nearby, int num_nearby);
+void load_rooms(void);
+void update_room_visibility(void);
+bool is_tile_in_view(int x, int y);
+bool is_object_room_visible(int object);
+float distance_to_segment(float x, float y, float x0, float y0, float x1, float y1);
+
+void batch_quad(const Texture *texture, SDL_FRect dest, SDL_FRect src, SDL_Color color);
+void flush_batch(void);
+void free_batch(void);
 
 void render_sprites(void);
+int collect_visible_objects(void);
+void build_depth_blocks(void);
+bool is_object_occluded(const VisibleObject *object);
+void project_object(const VisibleObject *object, int *line_height, int *screen_x);
+
+void render_walls_software(void);
+void render_wall_strip_software(int col_start, int col_end);
+void draw_wall_column_software(int x, int line_height, Texture *texture, float tex_offset, const LightLevel *light);
+void draw_flats_software(int col_start, int col_end, const int *wall_start, const int *wall_end);
+void setup_flat_row(int y, int layer, FlatRow *flat);
+void fill_flats_software(int col_start, int col_end, const int *wall_start, const int *wall_end);
+void fill_flat_span(Uint32 *row, int col_start, int col_end, int y, const int *walls, bool is_floor);
+#ifdef HAVE_PACKET_RAYCASTER
+int fill_flat_span_sse2(Uint32 *row, int col_start, int col_end, int y, const int *walls, bool is_floor);
+#endif
+void draw_flat_span(Uint32 *row, int col_start, int col_end, const FlatRow *flat);
+void draw_flat_span_scalar(Uint32 *row, int col_start, int col_end, const FlatRow *flat);
+#ifdef HAVE_PACKET_RAYCASTER
+void draw_flat_span_avx2(Uint32 *row, int col_start, int col_end, const FlatRow *flat);
+#endif
+int mip_level(const Texture *texture, int texels, int size);
+void render_sprites_software(void);
+void render_sprite_strip_software(int col_start, int col_end);
+void render_framebuffer(void);
+void present_view(void);
+
+void render_strips(render_strip_fn render_strip);
+void render_pool_run_strips(void);
+int render_pool_worker(void *data);
 void render_text(const char *message, SDL_Color color, SDL_Color outline_color, int x, int y);
+void set_text(Text *text, const char *content);
+void draw_text(const Text *text, int x, int y, SDL_Color color);
 void render_ui(void);
 
 void fire_projectile(void);
 void free_maps(void);
 void load_maps(const char *filename);
+void load_tile_grid(void);
+void load_text_map(const char *filename);
+bool is_compiled_map(const char *filename);
+void load_compiled_map(const char *filename);
+void check_compiled_map(const char *filename, const MapHeader *header);
+void check_compiled_cells(const char *filename, const MapHeader *header);
+Uint64 map_checksum(const void *data, size_t size);
+void spawn_map_objects(const char *filename);
+bool is_valid_fog(const MapFog *fog);
+void build_light_tables(void);
+void build_row_colors(void);
+const LightLevel *light_level(wall_collision_result_t face, float distance);
+void compile_map(const char *filename, const char *output_filename);
+void load_flat_layers(FILE *file, const char *filename);
 void wait_for_key_press();
 
 void load_sound(void);
 void free_sound(void);
 
 void load_textures(void);
+void load_mip_levels(Texture *texture);
+void load_texture_atlas(void);
+void load_flat_texels(void);
+int compare_texture_heights(const void *a, const void *b);
 void free_textures(void);
 
+void load_glyph_atlas(void);
+void free_glyph_atlas(void);
+
+void load_view(void);
+void free_view(void);
+void adjust_view_scale(float frame_time);
+
+void load_render_pool(void);
+void free_render_pool(void);
+
+void parse_args(int argc, char *argv[]);
+
+void load_profiler(void);
+void free_profiler(void);
+void profile_begin(const char *name);
+void profile_end(void);
+void profile_next_frame(void);
+void render_profile_overlay(void);
+void write_profile_trace(void);
+
+void load_timing(void);
+void begin_tick(void);
+void run_tick(float tick_time);
+void pace_frame(void);
+
+void sample_input(Input *sample);
+void move_player(const Input *sample, float elapsed_time);
+void record_input_latency(void);
+void report_input_latency(void);
+
+void seed_random(Uint64 seed);
+Uint32 random_next(void);
+
+void load_replay(void);
+void start_replay(void);
+void free_replay(void);
+void read_replay_input(Input *sample);
+void record_replay_tick(const Input *sample);
+Uint64 state_hash(void);
+Uint64 hash_bytes(Uint64 hash, const void *data, size_t size);
+
+void load_bench(void);
+void load_bench_path(void);
+void free_bench(void);
+bool bench_move_player(void);
+void bench_record(bench_stage_t stage, Uint64 *stage_start);
+void bench_record_frame(Uint64 frame_start);
+void bench_report(void);
+int compare_floats(const void *left, const void *right);
+float percentile(const float *sorted, int count, float p);
+
 SDL_Window *window = NULL;
 SDL_Renderer *renderer = NULL;
 
 int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+
+    if (map_output_filename) {
+        compile_map(map_filename, map_output_filename);
+        return 0;
+    }
+
     fprintf(stderr, "Starting game...\n");
-    srand(time(NULL));
+    if (!rng.is_seeded) {
+        rng.seed = bench.is_enabled ? 0 : time(NULL);
+    }
+    load_replay();
+    seed_random(rng.seed);
 
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
-        fprintf(stderr, "SDL could not initialize: %s\n", SDL_GetError());
-        return 1;
+    /* benchmarks run without a display (unless asked for another video
+     * driver explicitly) and without sound */
+    if (bench.is_enabled) {
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
     }
 
-    if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 512) < 0) {
-        printf("Error initializing SDL_mixer: %s\n", Mix_GetError());
-        SDL_Quit();
+    if (SDL_Init(bench.is_enabled ? SDL_INIT_VIDEO : SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0) {
+        fprintf(stderr, "SDL could not initialize: %s\n", SDL_GetError());
         return 1;
     }
 
-    Mix_Music *music = Mix_LoadMUS("assets/melody.mid");
-    if (!music) {
-        printf("Error loading MIDI file: %s\n", Mix_GetError());
-        Mix_CloseAudio();
-        SDL_Quit();
-        return 1;
+    Mix_Music *music = NULL;
+    if (!bench.is_enabled) {
+        if (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 512) < 0) {
+            printf("Error initializing SDL_mixer: %s\n", Mix_GetError());
+            SDL_Quit();
+            return 1;
+        }
+
+        music = Mix_LoadMUS("assets/melody.mid");
+        if (!music) {
+            printf("Error loading MIDI file: %s\n", Mix_GetError());
+            Mix_CloseAudio();
+            SDL_Quit();
+            return 1;
+        }
     }
 
     if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
@@ -273,7 +1122,12 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    /* with vsync pacing SDL_RenderPresent waits for the display */
+    Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+    if (timing.pacing == PACING_VSYNC) {
+        renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+    }
+    renderer = SDL_CreateRenderer(window, -1, bench.is_enabled ? 0 : renderer_flags);
     if (renderer == NULL) {
         fprintf(stderr, "Renderer could not be created: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -281,10 +1135,22 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    load_sound();
+    load_timing();
+    init_raycaster();
+    if (!bench.is_enabled) {
+        load_sound();
+    }
     load_textures();
-    load_maps("assets/map.txt");
-    Mix_PlayMusic(music, -1);
+    load_glyph_atlas();
+    load_view();
+    load_render_pool();
+    load_profiler();
+    load_maps(map_filename);
+    load_bench();
+    start_replay();
+    if (music) {
+        Mix_PlayMusic(music, -1);
+    }
 
     SDL_Color white = {255, 255, 255, 255};
     SDL_Color black = {0, 0, 0, 255};
@@ -298,10 +1164,23 @@ int main(int argc, char *argv[]) {
     case GAME_RESULT_ABORT:
         fprintf(stderr, "Aborted");
         break;
+    case GAME_RESULT_BENCH_DONE:
+        bench_report();
+        break;
     }
 
+    report_input_latency();
+
+    write_profile_trace();
+    free_replay();
+    free_profiler();
+    free_bench();
     free_maps();
     free_sound();
+    free_render_pool();
+    free_view();
+    free_glyph_atlas();
+    free_batch();
     free_textures();
 
     Mix_FreeMusic(music);
@@ -314,35 +1193,128 @@ int main(int argc, char *argv[]) {
 
     SDL_Quit();
 
-    return 0;
+    return replay.mismatch_tick < 0 ? 0 : 1;
 }
 
 game_result_t game_loop(void)
 {
     bool is_running = true;
     SDL_Event event;
-    Uint32 current_time, last_time = SDL_GetTicks();
+    Uint64 last_time = SDL_GetPerformanceCounter();
+    Uint64 unsimulated_time = 0;
+    const float tick_time = 1000.0f / timing.tick_rate;
+
+    previous_player = player;
+    timing.next_frame = last_time;
 
     while (is_running) {
-        current_time = SDL_GetTicks();
-        Uint32 elapsed_time = current_time - last_time;
+        Uint64 current_time = SDL_GetPerformanceCounter();
+        unsimulated_time += current_time - last_time;
         last_time = current_time;
+        unsimulated_time = SDL_min(unsimulated_time, MAX_TICKS_PER_FRAME * timing.tick_duration);
+
+        profile_begin("frame");
 
+        profile_begin("handle_events");
         while (SDL_PollEvent(&event))
             handle_events(&event, &is_running);
+        profile_end();
 
-        if (has_no_things_to_do()) {
+        if (!bench.is_enabled && has_no_things_to_do()) {
+            profile_end();
             return GAME_RESULT_WIN;
         }
 
-        update_objects(elapsed_time);
+        Uint64 frame_start = SDL_GetPerformanceCounter();
+        Uint64 stage_start = frame_start;
+
+        profile_begin("update_objects");
+        float alpha;
+        if (replay.is_replaying) {
+            /* recorded input, also exactly one tick per frame */
+            if (replay.tick == replay.header.num_ticks) {
+                profile_end();
+                profile_end();
+                return GAME_RESULT_BENCH_DONE;
+            }
+            run_tick(tick_time);
+            alpha = 1.0f;
+        } else if (bench.is_enabled) {
+            /* scripted movement and exactly one tick per frame, however long
+             * the frame took */
+            begin_tick();
+            if (!bench_move_player()) {
+                profile_end();
+                profile_end();
+                return GAME_RESULT_BENCH_DONE;
+            }
+            update_objects(tick_time);
+            alpha = 1.0f;
+        } else {
+            while (unsimulated_time >= timing.tick_duration) {
+                run_tick(tick_time);
+                unsimulated_time -= timing.tick_duration;
+            }
+            alpha = (float)unsimulated_time / timing.tick_duration;
+        }
+        update_camera(alpha);
+        profile_end();
+        bench_record(BENCH_STAGE_UPDATE, &stage_start);
+
+        if (render_backend == RENDER_BACKEND_SOFTWARE) {
+            profile_begin("render_walls");
+            render_walls_software();
+            profile_end();
+            bench_record(BENCH_STAGE_WALLS, &stage_start);
+
+            profile_begin("render_sprites");
+            render_sprites_software();
+            profile_end();
+            bench_record(BENCH_STAGE_SPRITES, &stage_start);
+
+            profile_begin("upload_framebuffer");
+            render_framebuffer();
+            profile_end();
+            bench_record(BENCH_STAGE_PRESENT, &stage_start);
+        } else {
+            profile_begin("render_walls");
+            render_walls();
+            profile_end();
+            bench_record(BENCH_STAGE_WALLS, &stage_start);
+
+            profile_begin("render_sprites");
+            render_sprites();
+            profile_end();
+            bench_record(BENCH_STAGE_SPRITES, &stage_start);
+
+            profile_begin("present_view");
+            present_view();
+            profile_end();
+            bench_record(BENCH_STAGE_PRESENT, &stage_start);
+        }
 
-        render_walls();
-        render_sprites();
+        profile_begin("render_ui");
         render_ui();
+        render_profile_overlay();
+        profile_end();
+        bench_record(BENCH_STAGE_UI, &stage_start);
+
+        if (view.is_auto) {
+            adjust_view_scale((float)(SDL_GetPerformanceCounter() - frame_start) * 1000.0f /
+                              SDL_GetPerformanceFrequency());
+        }
 
+        profile_begin("present");
         SDL_RenderPresent(renderer);
-        SDL_Delay(16);
+        record_input_latency();
+        profile_end();
+        bench_record(BENCH_STAGE_PRESENT, &stage_start);
+        bench_record_frame(frame_start);
+
+        profile_end();
+        profile_next_frame();
+
+        pace_frame();
     }
 #if __EMSCRIPTEN__
     return;
@@ -351,638 +1323,2802 @@ game_result_t game_loop(void)
 #endif
 }
 
-void handle_events(SDL_Event *event, bool *is_running) {
-    switch (event->type) {
-    case SDL_QUIT:
-        *is_running = false;
-        break;
-    case SDL_KEYDOWN:
-        /* Handling key presses */
-        if (event->key.keysym.sym == SDLK_ESCAPE) {
-            *is_running = false;
-        } else if (event->key.keysym.sym == SDLK_SPACE) {
-            fire_projectile();
-        } else if (event->key.keysym.sym == SDLK_UP) {
-            float new_x = player.x + cosf(player.direction) * PLAYER_MOVEMENT_SPEED;
-            float new_y = player.y + sinf(player.direction) * PLAYER_MOVEMENT_SPEED;
-            if (!is_move_collision(new_x, new_y)) {
-                player.x = new_x;
-                player.y = new_y;
-            }
-        } else if (event->key.keysym.sym == SDLK_DOWN) {
-            float new_x = player.x - cosf(player.direction) * PLAYER_MOVEMENT_SPEED;
-            float new_y = player.y - sinf(player.direction) * PLAYER_MOVEMENT_SPEED;
-            if (!is_move_collision(new_x, new_y)) {
-                player.x = new_x;
-                player.y = new_y;
-            }
-        } else if (event->key.keysym.sym == SDLK_LEFT) {
-            player.direction -= PLAYER_ROTATION_SPEED;
-        } else if (event->key.keysym.sym == SDLK_RIGHT) {
-            player.direction += PLAYER_ROTATION_SPEED;
-        }
+/* Keep the state of the last tick around for interpolation before simulating
+ * the next one */
+void begin_tick(void) {
+    previous_player = player;
+    memcpy(objects.prev_x, objects.x, num_objects * sizeof(objects.x[0]));
+    memcpy(objects.prev_y, objects.y, num_objects * sizeof(objects.y[0]));
+}
 
-        // Wrap player.direction within the range [0, 2 * M_PI]
-        player.direction = fmod(player.direction, 2 * M_PI);
-        if (player.direction < 0) {
-            player.direction += 2 * M_PI;
-        }
+/* One simulation tick driven by the held keys or the replayed input */
+void run_tick(float tick_time) {
+    begin_tick();
+    if (replay.is_replaying) {
+        read_replay_input(&input.current);
+    } else {
+        sample_input(&input.current);
+    }
 
-        break;
-        /* Handle other event types here */
-    default:
-        break;
+    if (input.current.fire) {
+        fire_projectile();
     }
+    move_player(&input.current, tick_time);
+    update_objects(tick_time);
+
+    record_replay_tick(&input.current);
 }
 
-void render_walls(void) {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
+/* Read the keys held right now rather than waiting for key events, which
+ * only repeat at the OS key repeat rate */
+void sample_input(Input *sample) {
+    const Uint8 *keys = SDL_GetKeyboardState(NULL);
+    sample->forward = keys[SDL_SCANCODE_UP];
+    sample->backward = keys[SDL_SCANCODE_DOWN];
+    sample->turn_left = keys[SDL_SCANCODE_LEFT];
+    sample->turn_right = keys[SDL_SCANCODE_RIGHT];
+    sample->fire = input.is_fire_requested;
+    input.is_fire_requested = false;
+
+    if (input.is_press_pending) {
+        input.is_press_pending = false;
+        input.is_press_applied = true;
+    }
+}
 
-    /* Draw the ceiling (white) */
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    SDL_Rect ceiling_rect = {0, 0, WINDOW_WIDTH, WINDOW_HEIGHT / 2};
-    SDL_RenderFillRect(renderer, &ceiling_rect);
+/* Turn and move the player as far as the elapsed time allows. A blocked move
+ * slides along the wall by trying the x and y parts of it on their own. */
+void move_player(const Input *sample, float elapsed_time) {
+    float turn = (sample->turn_right - sample->turn_left) * PLAYER_ROTATION_SPEED * elapsed_time;
+    player.direction += turn;
 
-    /* Draw the floor (grey) */
-    SDL_SetRenderDrawColor(renderer, 128, 128, 128, 255);
-    SDL_Rect floor_rect = {0, WINDOW_HEIGHT / 2, WINDOW_WIDTH, WINDOW_HEIGHT / 2};
-    SDL_RenderFillRect(renderer, &floor_rect);
+    // Wrap player.direction within the range [0, 2 * M_PI]
+    player.direction = fmod(player.direction, 2 * M_PI);
+    if (player.direction < 0) {
+        player.direction += 2 * M_PI;
+    }
 
-    /* Values for darker/lighter textures, i.e. fake shading */
-    Uint8 dark_r = 255, dark_g = 255, dark_b = 255;
-    dark_r = (Uint8)SDL_clamp(dark_r + 20, 0, 255);
-    dark_g = (Uint8)SDL_clamp(dark_g + 20, 0, 255);
-    dark_b = (Uint8)SDL_clamp(dark_b + 20, 0, 255);
-    Uint8 light_r = 255, light_g = 255, light_b = 255;
-    light_r = (Uint8)SDL_clamp(light_r - 20, 0, 255);
-    light_g = (Uint8)SDL_clamp(light_g - 20, 0, 255);
-    light_b = (Uint8)SDL_clamp(light_b - 20, 0, 255);
+    float step = (sample->forward - sample->backward) * PLAYER_MOVEMENT_SPEED * elapsed_time;
+    if (step == 0.0f) {
+        return;
+    }
 
+    float new_x = player.x + cosf(player.direction) * step;
+    float new_y = player.y + sinf(player.direction) * step;
+    if (!is_move_collision(new_x, new_y)) {
+        player.x = new_x;
+        player.y = new_y;
+    } else if (!is_move_collision(new_x, player.y)) {
+        player.x = new_x;
+    } else if (!is_move_collision(player.x, new_y)) {
+        player.y = new_y;
+    }
+}
 
-    /* Draw walls using texture mapping */
-    const float rays_per_column = (WINDOW_WIDTH / RAY_COUNT);
-    const float angle_per_ray = (FOV / (float)RAY_COUNT);
+/* Called right after a frame is presented */
+void record_input_latency(void) {
+    if (!input.is_press_applied) {
+        return;
+    }
 
-    for (int i = 0; i < RAY_COUNT; i++) {
-        float ray_angle = player.direction - FOV / 2.0 + i * angle_per_ray;
+    input.is_press_applied = false;
+    input.latencies[input.num_latencies++ % INPUT_LATENCY_SAMPLES] = SDL_GetTicks() - input.press_time;
+}
 
-        char wall_type;
-        float tex_offset;
-        wall_collision_result_t wall_collision;
+/* Print input to present latency statistics (milliseconds) of the latest key
+ * presses to stderr */
+void report_input_latency(void) {
+    if (!input.is_reported) {
+        return;
+    }
 
-        float raw_distance = cast_ray(ray_angle, &wall_type, &tex_offset, &wall_collision);
+    int count = SDL_min(input.num_latencies, INPUT_LATENCY_SAMPLES);
+    if (count == 0) {
+        fprintf(stderr, "No input latency samples were recorded\n");
+        return;
+    }
 
-        /* use a conversion table to turn wall_type into a texture for drawing */
-        SDL_Texture *texture = *char_to_texture_table[wall_type];
+    float sorted[INPUT_LATENCY_SAMPLES];
+    memcpy(sorted, input.latencies, count * sizeof(sorted[0]));
+    qsort(sorted, count, sizeof(sorted[0]), compare_floats);
 
-        /* Shade based on wall collision results (horizontal/vertical)*/
-        if (wall_collision == HIT_HORIZONTAL) {
-            SDL_SetTextureColorMod(texture, light_r, light_g, light_b);
-        } else if (wall_collision == HIT_VERTICAL) {
-            SDL_SetTextureColorMod(texture, dark_r, dark_g, dark_b);
-        }
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sum += sorted[i];
+    }
 
-        /* Calculate the line height while correcting for the fisheye effect */
-        float corrected_distance = raw_distance * cosf(player.direction - ray_angle);
-        int line_height = (int)(WINDOW_HEIGHT / corrected_distance);
+    fprintf(stderr, "Input to present latency over %d key presses: min %.1f, mean %.1f, p50 %.1f, p95 %.1f, max %.1f ms\n",
+            count, sorted[0], sum / count, percentile(sorted, count, 50), percentile(sorted, count, 95), sorted[count - 1]);
+}
 
-        /* Save line height in a depth buffer to use in in sprite rendering */
-        line_height_buffer[i] = line_height;
+/* Open the file to record to, or read the header of the one to replay. The
+ * replay decides the seed, the tick rate and the number of frames. */
+void load_replay(void) {
+    if (replay.is_recording) {
+        replay.file = fopen(replay.filename, "wb");
+        if (replay.file == NULL) {
+            fprintf(stderr, "Error opening replay file: %s\n", replay.filename);
+            exit(1);
+        }
+        return;
+    }
 
-        /* Set the source rectangle for the texture */
-        int tex_rect_x = (int)(tex_offset * (float)TEXTURE_WIDTH);
-        int tex_rect_y = 0;
-        SDL_Rect src_rect = {tex_rect_x, tex_rect_y, 1, TEXTURE_HEIGHT};
+    if (!replay.is_replaying) {
+        return;
+    }
 
-        /* Set the destination rectangle for the texture */
-        SDL_Rect dest_rect = {i * rays_per_column, (WINDOW_HEIGHT - line_height) / 2, rays_per_column, line_height};
+    replay.file = fopen(replay.filename, "rb");
+    if (replay.file == NULL) {
+        fprintf(stderr, "Error opening replay file: %s\n", replay.filename);
+        exit(1);
+    }
 
-        /* Render the textured wall */
-        SDL_RenderCopy(renderer, texture, &src_rect, &dest_rect);
+    ReplayHeader *header = &replay.header;
+    if (fread(header, sizeof(*header), 1, replay.file) != 1 ||
+        memcmp(header->magic, REPLAY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != REPLAY_VERSION || header->tick_rate == 0) {
+        fprintf(stderr, "Not a replay file or an unsupported version: %s\n", replay.filename);
+        exit(1);
+    }
+    if (header->num_ticks == 0) {
+        fprintf(stderr, "No ticks in the replay file: %s\n", replay.filename);
+        exit(1);
     }
-}
 
-/* check if the tile at x, y is a wall */
-bool is_wall(int x, int y) {
-    return isdigit(map[y][x]);
+    rng.seed = header->seed;
+    timing.tick_rate = header->tick_rate;
+    bench.num_frames = header->num_ticks;
 }
 
-bool is_within_bounds(int x, int y) {
-    return x >= 0 && x < map_width && y >= 0 && y < map_height;
+/* With the level loaded: write the header, or make sure the replay starts
+ * from the same level */
+void start_replay(void) {
+    if (replay.is_recording) {
+        replay.header = (ReplayHeader){
+            .magic = REPLAY_MAGIC,
+            .version = REPLAY_VERSION,
+            .tick_rate = timing.tick_rate,
+            .seed = rng.seed,
+            .initial_hash = state_hash()
+        };
+        if (fwrite(&replay.header, sizeof(replay.header), 1, replay.file) != 1) {
+            fprintf(stderr, "Error writing replay file: %s\n", replay.filename);
+            exit(1);
+        }
+    } else if (replay.is_replaying && replay.header.initial_hash != state_hash()) {
+        fprintf(stderr, "The replay was recorded on another map than %s\n", map_filename);
+        exit(1);
+    }
 }
 
-float cast_ray(float angle, char *wall_type, float *tex_offset, wall_collision_result_t *collision_res) {
-    Vector2 direction = {cosf(angle), sinf(angle)};
-    float distance = 0.0;
-    Vector2 position = {player.x, player.y};
-
-    while (distance < MAX_DISTANCE) {
-        float new_x = position.x + direction.x * RAY_STEP;
-        float new_y = position.y + direction.y * RAY_STEP;
+/* Finish the recording by putting the number of ticks into the header, and
+ * say how the replay went */
+void free_replay(void) {
+    if (replay.file == NULL) {
+        return;
+    }
 
-        *collision_res = is_wall_collision(new_x, new_y, wall_type, tex_offset);
-        if (*collision_res) {
-            break;
+    if (replay.is_recording) {
+        replay.header.num_ticks = replay.tick;
+        if (fseek(replay.file, 0, SEEK_SET) != 0 ||
+            fwrite(&replay.header, sizeof(replay.header), 1, replay.file) != 1 ||
+            fclose(replay.file) != 0) {
+            fprintf(stderr, "Error writing replay file: %s\n", replay.filename);
+            exit(1);
         }
-
-        if (is_door_collision(new_x, new_y, wall_type, tex_offset, false)) {
-            break;
+        fprintf(stderr, "Recorded %u ticks with seed %llu to %s\n", replay.tick,
+                (unsigned long long)replay.header.seed, replay.filename);
+    } else {
+        fclose(replay.file);
+        if (replay.mismatch_tick < 0) {
+            fprintf(stderr, "Replayed %u ticks, the state matched the recording on every tick\n", replay.tick);
+        } else {
+            fprintf(stderr, "Replayed %u ticks, the state diverged from the recording at tick %lld\n",
+                    replay.tick, (long long)replay.mismatch_tick);
         }
+    }
+    replay.file = NULL;
+}
 
-        position.x = new_x;
-        position.y = new_y;
-
-        distance += RAY_STEP;
+void read_replay_input(Input *sample) {
+    Uint8 bits;
+    if (fread(&bits, sizeof(bits), 1, replay.file) != 1) {
+        fprintf(stderr, "Truncated replay file: %s\n", replay.filename);
+        exit(1);
     }
 
-    return distance;
+    *sample = (Input){
+        .forward = bits & REPLAY_INPUT_FORWARD,
+        .backward = bits & REPLAY_INPUT_BACKWARD,
+        .turn_left = bits & REPLAY_INPUT_TURN_LEFT,
+        .turn_right = bits & REPLAY_INPUT_TURN_RIGHT,
+        .fire = bits & REPLAY_INPUT_FIRE
+    };
 }
 
-bool is_move_collision(float x, float y) {
-    char wall_type = '\0';
-    float offset = 0.0f;
-    return is_wall_collision(x, y, &wall_type, &offset) ||
-        is_door_collision(x, y, &wall_type, &offset, true);
+/* Write the input of the tick just simulated and the resulting state hash,
+ * or check the hash against the recorded one */
+void record_replay_tick(const Input *sample) {
+    if (replay.is_recording) {
+        Uint8 bits = (sample->forward ? REPLAY_INPUT_FORWARD : 0) |
+            (sample->backward ? REPLAY_INPUT_BACKWARD : 0) |
+            (sample->turn_left ? REPLAY_INPUT_TURN_LEFT : 0) |
+            (sample->turn_right ? REPLAY_INPUT_TURN_RIGHT : 0) |
+            (sample->fire ? REPLAY_INPUT_FIRE : 0);
+        Uint32 hash = (Uint32)state_hash();
+        if (fwrite(&bits, sizeof(bits), 1, replay.file) != 1 ||
+            fwrite(&hash, sizeof(hash), 1, replay.file) != 1) {
+            fprintf(stderr, "Error writing replay file: %s\n", replay.filename);
+            exit(1);
+        }
+    } else if (replay.is_replaying) {
+        Uint32 hash;
+        if (fread(&hash, sizeof(hash), 1, replay.file) != 1) {
+            fprintf(stderr, "Truncated replay file: %s\n", replay.filename);
+            exit(1);
+        }
+        if (hash != (Uint32)state_hash() && replay.mismatch_tick < 0) {
+            fprintf(stderr, "Replay diverged at tick %u\n", replay.tick);
+            replay.mismatch_tick = replay.tick;
+        }
+    } else {
+        return;
+    }
+
+    replay.tick++;
 }
 
-bool is_door(int map_x, int map_y) {
-    char c = map[map_y][map_x];
-    return c == '-' || c == '|';
+/* Hash of everything the simulation decides: the player, the objects, the
+ * doors and the counters. Texture pointers differ from run to run and are
+ * left out. */
+Uint64 state_hash(void) {
+    Uint64 hash = hash_bytes(0xcbf29ce484222325ULL, &player, sizeof(player));
+    hash = hash_bytes(hash, &coins_collected, sizeof(coins_collected));
+    hash = hash_bytes(hash, &todo_left, sizeof(todo_left));
+    hash = hash_bytes(hash, &num_objects, sizeof(num_objects));
+    hash = hash_bytes(hash, objects.x, num_objects * sizeof(objects.x[0]));
+    hash = hash_bytes(hash, objects.y, num_objects * sizeof(objects.y[0]));
+    hash = hash_bytes(hash, objects.flags, num_objects * sizeof(objects.flags[0]));
+    hash = hash_bytes(hash, objects.kind, num_objects * sizeof(objects.kind[0]));
+    for (int door = 0; door < level.num_doors; door++) {
+        const ObjectState *state = &objects.state[level.door_objects[door]];
+        hash = hash_bytes(hash, &state->as.door.door_width, sizeof(state->as.door.door_width));
+        hash = hash_bytes(hash, &state->as.door.is_open, sizeof(state->as.door.is_open));
+    }
+    hash = hash_bytes(hash, &rng.state, sizeof(rng.state));
+    return hash;
 }
 
-bool is_door_collision(float x, float y, char *wall_type, float *tex_offset, bool check_if_open) {
-    int map_x = (int)floor(x);
-    int map_y = (int)floor(y);
+/* Sleep until the next frame is due. SDL_Delay is only as precise as the OS
+ * scheduler, so it sleeps up to about a millisecond before the deadline and
+ * the rest is spent spinning. Frames that are late move the deadline instead
+ * of being followed by a burst of frames to catch up. */
+void pace_frame(void) {
+    if (timing.pacing != PACING_SLEEP || bench.is_enabled) {
+        return;
+    }
 
-    /* check if the tile is right */
-    if (!is_door(map_x, map_y)) {
-        return false;
+    profile_begin("pace_frame");
+    const Uint64 frequency = SDL_GetPerformanceFrequency();
+    Uint64 now = SDL_GetPerformanceCounter();
+    timing.next_frame += timing.frame_duration;
+    if (now > timing.next_frame) {
+        timing.next_frame = now;
     }
 
-    *wall_type = map[map_y][map_x];
+    while (now < timing.next_frame) {
+        Uint64 remaining_ms = (timing.next_frame - now) * 1000 / frequency;
+        if (remaining_ms > 1) {
+            SDL_Delay(remaining_ms - 1);
+        }
+        now = SDL_GetPerformanceCounter();
+    }
+    profile_end();
+}
 
-    Object *door_object = door_map[map_y][map_x];
-    float door_width = door_object->as.door.door_width;
+/* Tick and frame durations in performance counter units. The frame time
+ * budget of the automatic view scale defaults to 3/4 of a frame, the rest is
+ * left to presenting. */
+void load_timing(void) {
+    const Uint64 frequency = SDL_GetPerformanceFrequency();
+    timing.tick_duration = frequency / timing.tick_rate;
+    timing.frame_duration = frequency / timing.frame_rate;
+    if (view.budget == 0.0f) {
+        view.budget = 750.0f / timing.frame_rate;
+    }
+}
 
-    /* for movememnt purposes closed and partially closed doors are not transparent */
-    if (check_if_open && !door_object->as.door.is_open) {
-        return true;
+/* Move the player along the benchmark camera path, interpolating between
+ * keyframes. Returns false once the path is over. */
+bool bench_move_player(void) {
+    if (bench.frame >= bench.num_frames) {
+        return false;
     }
 
-    /* horizontal door */
-    if (map[map_y][map_x] == '-') {
-        /* distance to door tile horisontal middle line */
-        float y_diff = fabs(fabs(roundf(y) - y) - 0.5);
+    int frame = bench.frame;
+    int k = 0;
+    while (frame >= bench.keyframes[k].frames) {
+        frame -= bench.keyframes[k].frames;
+        k++;
+    }
 
-        /* door width is 0.02 x 2 */
-        if (y_diff >= 0.02f) {
-            return false;
-        }
+    BenchKeyframe *from = &bench.keyframes[k];
+    BenchKeyframe *to = k + 1 < bench.num_keyframes ? &bench.keyframes[k + 1] : from;
+    float t = (float)frame / from->frames;
 
-        /* check if we hit a partially open door */
-        float x_diff = x - floorf(x);
-        if (x_diff < door_width) {
-            *tex_offset = 1 - door_width + x_diff;
-            return true;
-        }
+    player.x = from->x + (to->x - from->x) * t;
+    player.y = from->y + (to->y - from->y) * t;
+    player.direction = from->direction + (to->direction - from->direction) * t;
 
-        return false;
+    // Wrap player.direction within the range [0, 2 * M_PI]
+    player.direction = fmod(player.direction, 2 * M_PI);
+    if (player.direction < 0) {
+        player.direction += 2 * M_PI;
     }
 
-    /* vertical door */
-    if (map[map_y][map_x] == '|') {
-        /* distance to door tile vertical middle line */
-        float x_diff = fabs(fabs(roundf(x) - x) - 0.5);
+    return true;
+}
 
-        /* door width is 0.02 x 2 */
-        if (x_diff >= 0.02f) {
-            return false;
-        }
+/* Add the time since *stage_start to the given stage of the current frame and
+ * restart the stage clock */
+void bench_record(bench_stage_t stage, Uint64 *stage_start) {
+    if (!bench.is_enabled) {
+        return;
+    }
 
-        /* check if we hit a partially open door */
-        float y_diff = y - floorf(y);
-        if (y_diff < door_width) {
-            *tex_offset = 1 - door_width + y_diff;
-            return true;
-        }
+    Uint64 now = SDL_GetPerformanceCounter();
+    bench.stage_times[stage][bench.frame] += (now - *stage_start) * 1000.0 / SDL_GetPerformanceFrequency();
+    *stage_start = now;
+}
 
-        return false;
+/* Close the current benchmark frame */
+void bench_record_frame(Uint64 frame_start) {
+    if (!bench.is_enabled) {
+        return;
     }
 
-    /* unreachable */
-    return false;
+    Uint64 stage_start = frame_start;
+    bench_record(BENCH_STAGE_FRAME, &stage_start);
+    bench.frame++;
 }
 
-wall_collision_result_t is_wall_collision(float x, float y, char *wall_type, float *tex_offset) {
-    int map_x = (int)floor(x);
-    int map_y = (int)floor(y);
-    *wall_type = '\0';
+int compare_floats(const void *left, const void *right) {
+    float left_value = *(const float *)left;
+    float right_value = *(const float *)right;
+    return (left_value > right_value) - (left_value < right_value);
+}
 
-    /* if outside of bounds  - counts as wall*/
-    if (!is_within_bounds(map_x, map_y)) {
-        *wall_type = '1';
-        return HIT_HORIZONTAL;
-    }
+/* Nearest-rank percentile of sorted values */
+float percentile(const float *sorted, int count, float p) {
+    int rank = (int)ceilf(p / 100.0f * count);
+    return sorted[SDL_clamp(rank - 1, 0, count - 1)];
+}
 
-    if (!is_wall(map_x, map_y)) {
-        return HIT_NONE;
+/* Print frame time statistics (milliseconds) as JSON to stdout */
+void bench_report(void) {
+    int count = bench.frame;
+    if (count == 0) {
+        fprintf(stderr, "No benchmark frames were rendered\n");
+        return;
     }
 
-    *wall_type = map[map_y][map_x];
+    printf("{\n");
+    printf("  \"map\": \"%s\",\n", map_filename);
+    printf("  \"path\": \"%s\",\n", bench.path_filename);
+    printf("  \"backend\": \"%s\",\n", render_backend == RENDER_BACKEND_SOFTWARE ? "software" : "sdl");
+    printf("  \"raycaster\": \"%s\",\n", raycaster_names[raycaster]);
+    printf("  \"threads\": %d,\n", render_pool.num_workers + 1);
+    printf("  \"tick_rate\": %d,\n", timing.tick_rate);
+    printf("  \"view\": \"%dx%d\",\n", view.width, view.height);
+    printf("  \"frames\": %d,\n", count);
+    printf("  \"stages\": {\n");
+
+    float *sorted = malloc(count * sizeof(sorted[0]));
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        memcpy(sorted, bench.stage_times[stage], count * sizeof(sorted[0]));
+        qsort(sorted, count, sizeof(sorted[0]), compare_floats);
+
+        double sum = 0.0;
+        for (int i = 0; i < count; i++) {
+            sum += sorted[i];
+        }
 
-    /* check if horisontal or vertical wall, find texture offset accordingly */
-    wall_collision_result_t result;
-    if (fabs(roundf(x) - x) >= fabs(roundf(y) - y)) {
-        result = HIT_HORIZONTAL;
-        *tex_offset = x - floorf(x);
-    } else {
-        result = HIT_VERTICAL;
-        *tex_offset = y - floorf(y);
+        printf("    \"%s\": {\"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}%s\n",
+               bench_stage_names[stage], sorted[0], sum / count,
+               percentile(sorted, count, 50), percentile(sorted, count, 95), percentile(sorted, count, 99),
+               sorted[count - 1], stage + 1 < BENCH_STAGE_COUNT ? "," : "");
     }
+    free(sorted);
 
-    return result;
+    printf("  }\n");
+    printf("}\n");
 }
 
-bool has_no_things_to_do() {
-    for (int i = 0; i < num_objects; i++) {
-        if (!objects[i].is_harmless) {
-            return false;
-        }
+/* Frame times are kept for every frame of the camera path, or of the replay */
+void load_bench(void) {
+    if (!bench.is_enabled) {
+        return;
     }
-    return true;
-}
 
-void init_poo(Object *object, int x, int y) {
-    *object = (typeof(*object)) {
-        .texture = poo_texture,
-        .x = x + 0.5,
-        .y = y + 0.5,
-        .is_updateable = true,
-        .is_hittable = true,
-        .is_harmless = false,
-        .is_visible = true,
-        .is_touchable = true,
-        .touch_distance = 0.5,
-        .hit_distance = 0.5,
-        .hit = poo_hit,
-        .touch = poo_touch
-    };
+    if (!replay.is_replaying) {
+        load_bench_path();
+    }
 
-    todo_left++;
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        bench.stage_times[stage] = calloc(bench.num_frames, sizeof(bench.stage_times[stage][0]));
+    }
 }
 
-void poo_hit(Object *object) {
-    object->is_updateable = false;
-    object->is_hittable = false;
-    object->is_harmless = true;
-    object->is_visible = false;
-    object->is_touchable = false;
+/* Camera path: one keyframe per line, "x y direction frames" with the
+ * direction in degrees. The player moves from one keyframe to the next in the
+ * given number of frames, the last one is held for its frames. Empty lines and
+ * lines starting with # are ignored. */
+void load_bench_path(void) {
+    FILE *file = fopen(bench.path_filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening camera path file: %s\n", bench.path_filename);
+        exit(1);
+    }
 
-    todo_left--;
-}
+    char line[256];
+    int capacity = 0;
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
 
-void poo_touch(Object *object) {
-    if (coins_collected)
-        coins_collected--;
+        char *start = line;
+        while (isspace(*start)) {
+            start++;
+        }
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
 
-    poo_hit(object);
+        BenchKeyframe keyframe;
+        float degrees;
+        if (sscanf(start, "%f %f %f %d", &keyframe.x, &keyframe.y, &degrees, &keyframe.frames) != 4 ||
+            keyframe.frames <= 0) {
+            fprintf(stderr, "Bad camera path keyframe at %s:%d\n", bench.path_filename, line_number);
+            exit(1);
+        }
+        keyframe.direction = degrees * M_PI / 180.0;
 
-    Mix_PlayChannel(-1, pain_sound, 0);
+        if (bench.num_keyframes == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            bench.keyframes = realloc(bench.keyframes, capacity * sizeof(bench.keyframes[0]));
+        }
+        bench.keyframes[bench.num_keyframes++] = keyframe;
+        bench.num_frames += keyframe.frames;
+    }
+    fclose(file);
+
+    if (bench.num_keyframes == 0) {
+        fprintf(stderr, "No keyframes in the camera path file: %s\n", bench.path_filename);
+        exit(1);
+    }
 }
 
-void init_fly(Object *object, int x, int y) {
-    *object = (typeof(*object)) {
-        .texture = fly_texture,
-        .x = x + 0.5,
-        .y = y + 0.5,
-        .is_updateable = true,
-        .is_harmless = false,
-        .is_visible = true,
-        .is_hittable = true,
-        .is_touchable = true,
+void free_bench(void) {
+    for (int stage = 0; stage < BENCH_STAGE_COUNT; stage++) {
+        free(bench.stage_times[stage]);
+    }
+    free(bench.keyframes);
+}
+
+/* Open a profiler zone on the calling thread, zones nest until closed with
+ * profile_end */
+void profile_begin(const char *name) {
+    if (!profiler.is_enabled) {
+        return;
+    }
 
-        .hit_distance = 0.25,
-        .touch_distance = 0.25,
+    ProfileRing *ring = &profiler.rings[profile_thread];
+    Uint32 index = ring->num_zones++;
+    ProfileZone *zone = &ring->zones[index & (PROFILE_RING_SIZE - 1)];
+    zone->name = name;
+    zone->frame = profiler.frame;
+    zone->depth = ring->depth;
+    zone->end = 0;
 
-        .update = fly_update,
-        .touch = fly_touch,
-        .hit = fly_hit
-    };
+    if (ring->depth < PROFILE_MAX_DEPTH) {
+        ring->open_zones[ring->depth] = index;
+    }
+    ring->depth++;
 
-    todo_left++;
+    zone->start = SDL_GetPerformanceCounter();
 }
 
-void fly_hit(Object *object) {
-    object->is_updateable = false;
-    object->is_hittable = false;
-    object->is_harmless = true;
-    object->is_visible = false;
-    object->is_touchable = false;
+void profile_end(void) {
+    if (!profiler.is_enabled) {
+        return;
+    }
 
-    todo_left--;
+    Uint64 now = SDL_GetPerformanceCounter();
+    ProfileRing *ring = &profiler.rings[profile_thread];
+    ring->depth--;
+    if (ring->depth < PROFILE_MAX_DEPTH) {
+        ring->zones[ring->open_zones[ring->depth] & (PROFILE_RING_SIZE - 1)].end = now;
+    }
 }
 
-void fly_touch(Object *object) {
-    if (coins_collected)
-        coins_collected--;
-
-    fly_hit(object);
+/* Zones recorded from now on belong to the next frame */
+void profile_next_frame(void) {
+    profiler.frame++;
+}
 
-    Mix_PlayChannel(-1, pain_sound, 0);
+double profile_ms(Uint64 duration) {
+    return duration * 1000.0 / SDL_GetPerformanceFrequency();
 }
 
-void init_projectile(Object *object) {
-    *object = (typeof(*object)) {
-        .texture = brush_texture,
-        .is_updateable = false,
-        .is_hittable = false,
-        .is_visible = false,
-        .is_harmless = true,
-        .update = projectile_update
-    };
+/* Draw the game loop stages of the last frames as stacked bars, one bar per
+ * frame, with a line at the 60 FPS budget */
+void render_profile_overlay(void) {
+    if (!profiler.is_enabled || !profiler.is_overlay_visible) {
+        return;
+    }
 
-}
+    const int bar_width = 4;
+    const int pixels_per_ms = 8;
+    const int graph_height = 40 * pixels_per_ms;
+    const int left = 10;
+    const int bottom = WINDOW_HEIGHT - 10;
+
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_Rect background = {left, bottom - graph_height, PROFILE_OVERLAY_FRAMES * bar_width, graph_height};
+    SDL_RenderFillRect(renderer, &background);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+
+    /* stage zones of complete frames, newest first */
+    ProfileRing *ring = &profiler.rings[0];
+    Uint32 first_zone = ring->num_zones > PROFILE_RING_SIZE ? ring->num_zones - PROFILE_RING_SIZE : 0;
+    int stack_top[PROFILE_OVERLAY_FRAMES];
+    for (int i = 0; i < PROFILE_OVERLAY_FRAMES; i++) {
+        stack_top[i] = bottom;
+    }
+
+    for (Uint32 index = ring->num_zones; index-- > first_zone;) {
+        ProfileZone *zone = &ring->zones[index & (PROFILE_RING_SIZE - 1)];
+        Uint32 age = profiler.frame - zone->frame;
+        if (age > PROFILE_OVERLAY_FRAMES) {
+            break;
+        }
+        if (age == 0 || zone->depth != 1 || zone->end == 0) {
+            continue;
+        }
 
-void projectile_update(Object *projectile, Uint32 elapsed_time) {
-    float dx = projectile->direction.x * PROJECTILE_SPEED * elapsed_time;
-    float dy = projectile->direction.y * PROJECTILE_SPEED * elapsed_time;
+        const ProfileStage *stage = &profile_stages[PROFILE_STAGE_COUNT - 1];
+        for (int i = 0; i < PROFILE_STAGE_COUNT - 1; i++) {
+            if (strcmp(zone->name, profile_stages[i].name) == 0) {
+                stage = &profile_stages[i];
+                break;
+            }
+        }
 
-    float new_x = projectile->x + dx;
-    float new_y = projectile->y + dy;
+        int bar = PROFILE_OVERLAY_FRAMES - age;
+        int height = (int)(profile_ms(zone->end - zone->start) * pixels_per_ms + 0.5);
+        height = SDL_min(height, stack_top[bar] - (bottom - graph_height));
+        stack_top[bar] -= height;
 
-    if (is_move_collision(new_x, new_y)) {
-        goto remove_projectile;
+        SDL_SetRenderDrawColor(renderer, stage->color.r, stage->color.g, stage->color.b, 255);
+        SDL_Rect rect = {left + bar * bar_width, stack_top[bar], bar_width - 1, height};
+        SDL_RenderFillRect(renderer, &rect);
     }
 
-    /* move the project to the new position */
-    projectile->x = new_x;
-    projectile->y = new_y;
-
-    /* check all other objects but skip the first one - itself */
-    for (int j = 1; j < num_objects; j++) {
-        if (!objects[j].is_hittable) {
+    /* 60 FPS budget */
+    int budget_y = bottom - (int)(1000.0 / 60.0 * pixels_per_ms);
+    SDL_SetRenderDrawColor(renderer, 255, 0, 0, 255);
+    SDL_RenderDrawLine(renderer, left, budget_y, left + PROFILE_OVERLAY_FRAMES * bar_width, budget_y);
+
+    /* legend */
+    int legend_x = left + PROFILE_OVERLAY_FRAMES * bar_width + 10;
+    int legend_y = bottom - graph_height;
+    for (int i = 0; i < PROFILE_STAGE_COUNT; i++) {
+        SDL_Texture *label = profiler.stage_labels[i];
+        if (label == NULL) {
             continue;
         }
-        float dist_x = objects[j].x - projectile->x;
-        float dist_y = objects[j].y - projectile->y;
-        float distance = sqrtf(dist_x * dist_x + dist_y * dist_y);
 
-        if (distance < objects[j].hit_distance) {
-            objects[j].hit(&objects[j]);
+        int w, h;
+        SDL_QueryTexture(label, NULL, NULL, &w, &h);
+        w /= 3;
+        h /= 3;
 
-            Mix_PlayChannel(-1, brush_sound, 0);
+        SDL_SetRenderDrawColor(renderer, profile_stages[i].color.r, profile_stages[i].color.g, profile_stages[i].color.b, 255);
+        SDL_Rect swatch = {legend_x, legend_y + h / 4, h / 2, h / 2};
+        SDL_RenderFillRect(renderer, &swatch);
 
-            goto remove_projectile;
+        SDL_Rect label_rect = {legend_x + h, legend_y, w, h};
+        SDL_RenderCopy(renderer, label, NULL, &label_rect);
+        legend_y += h;
+    }
+}
+
+/* Write the recorded zones of every thread as Chrome trace events, viewable
+ * in chrome://tracing or Perfetto */
+void write_profile_trace(void) {
+    if (!profiler.is_enabled || profiler.trace_filename == NULL) {
+        return;
+    }
+
+    FILE *file = fopen(profiler.trace_filename, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening trace file: %s\n", profiler.trace_filename);
+        return;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool is_first = true;
+    for (int thread = 0; thread < profiler.num_threads; thread++) {
+        fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                is_first ? "" : ",\n", thread, thread == 0 ? "main" : "render");
+        is_first = false;
+
+        ProfileRing *ring = &profiler.rings[thread];
+        Uint32 first_zone = ring->num_zones > PROFILE_RING_SIZE ? ring->num_zones - PROFILE_RING_SIZE : 0;
+        for (Uint32 index = first_zone; index < ring->num_zones; index++) {
+            ProfileZone *zone = &ring->zones[index & (PROFILE_RING_SIZE - 1)];
+            if (zone->end == 0) {
+                continue;
+            }
+
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %u}}",
+                    zone->name, thread,
+                    profile_ms(zone->start - profiler.start_time) * 1000.0,
+                    profile_ms(zone->end - zone->start) * 1000.0,
+                    zone->frame);
         }
     }
-    return;
+    fprintf(file, "\n]}\n");
+    fclose(file);
 
-remove_projectile:
-    projectile->is_visible = false;
-    projectile->is_updateable = false;
+    fprintf(stderr, "Wrote the profiler trace to %s\n", profiler.trace_filename);
 }
 
-float random_float(float min, float max) {
-    float scale = rand() / (float) RAND_MAX;
-    return min + scale * (max - min);
+void handle_events(SDL_Event *event, bool *is_running) {
+    switch (event->type) {
+    case SDL_QUIT:
+        *is_running = false;
+        break;
+    case SDL_KEYDOWN:
+        /* Handling key presses */
+        if (event->key.keysym.sym == SDLK_ESCAPE) {
+            *is_running = false;
+        } else if (event->key.keysym.sym == SDLK_SPACE) {
+            /* thrown by the next tick, so that it gets recorded with it */
+            input.is_fire_requested = true;
+        } else if (event->key.keysym.sym == SDLK_F3) {
+            profiler.is_overlay_visible = !profiler.is_overlay_visible;
+        } else if ((event->key.keysym.sym == SDLK_UP || event->key.keysym.sym == SDLK_DOWN ||
+                    event->key.keysym.sym == SDLK_LEFT || event->key.keysym.sym == SDLK_RIGHT) &&
+                   !event->key.repeat && !input.is_press_pending && !input.is_press_applied) {
+            /* movement itself comes from the held keys sampled every tick,
+             * the press only starts a latency measurement */
+            input.is_press_pending = true;
+            input.press_time = event->key.timestamp;
+        }
+
+        break;
+        /* Handle other event types here */
+    default:
+        break;
+    }
 }
 
-void fly_update(Object *object, Uint32 elapsed_time) {
-    /* Speed factor*/
-    const float speed = 0.002f;
+void render_walls(void) {
+    SDL_SetRenderTarget(renderer, view.texture);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
 
-    /* random directions */
-    float dx = random_float(-1.0f, 1.0f);
-    float dy = random_float(-1.0f, 1.0f);
+    /* Draw the ceiling (white) and the floor (grey), fogged in bands of rows
+     * of the same color */
+    int band_start = 0;
+    for (int y = 1; y <= view.height; y++) {
+        if (y < view.height && lighting.row_colors[y] == lighting.row_colors[band_start]) {
+            continue;
+        }
+        Uint32 color = lighting.row_colors[band_start];
+        batch_quad(NULL, (SDL_FRect){0, band_start, view.width, y - band_start}, (SDL_FRect){0, 0, 1, 1},
+                   (SDL_Color){color >> 16 & 0xFF, color >> 8 & 0xFF, color & 0xFF, 255});
+        band_start = y;
+    }
 
-    /* Scale the movement by the elapsed time and speed factor */
-    dx *= elapsed_time * speed;
-    dy *= elapsed_time * speed;
+    /* Draw walls using texture mapping */
+    profile_begin("cast_rays");
+    cast_rays(0, view.width);
+    profile_end();
 
-    /* Calculate the new position */
-    float new_x = object->x + dx;
-    float new_y = object->y + dy;
+    profile_begin("draw_walls");
+    for (int i = 0; i < view.width; i++) {
+        RayHit *hit = &ray_hits[i];
 
-    /* Check if the new position is within map boundaries and not a wall */
-    int new_tile_x = (int)new_x;
-    int new_tile_y = (int)new_y;
+        /* Calculate the line height while correcting for the fisheye effect */
+        float corrected_distance = hit->distance * camera.column_cos[i];
+        int line_height = (int)(view.height / corrected_distance);
 
-    if (new_tile_x >= 0 && new_tile_x < map_width &&
-        new_tile_y >= 0 && new_tile_y < map_height &&
-        map[new_tile_y][new_tile_x] != '1') {
+        Texture *wall = wall_textures[hit->texture];
+        Texture *level = &wall->levels[mip_level(wall, wall->height, line_height)];
+
+        /* Save line height in a depth buffer to use in in sprite rendering */
+        line_height_buffer[i] = line_height;
+
+        /* Set the source rectangle for the texture, in texture coordinates */
+        int tex_x = (int)(hit->tex_offset * (float)level->width);
+        SDL_FRect src_rect = {(float)tex_x / level->width, 0.0f, 1.0f / level->width, 1.0f};
+
+        /* Set the destination rectangle for the texture */
+        SDL_FRect dest_rect = {i, (view.height - line_height) / 2, 1, line_height};
 
-        object->x = new_x;
-        object->y = new_y;
+        /* Queue the textured wall, shaded based on wall collision results
+         * (horizontal/vertical) and distance */
+        const LightLevel *light = light_level(hit->collision, hit->distance);
+        batch_quad(level, dest_rect, src_rect, light->modulation);
     }
+    flush_batch();
+    build_depth_blocks();
+    profile_end();
 }
 
-void init_flower(Object *object, int x, int y) {
-    *object = (typeof(*object)) {
-        .texture = flower_unwatered_texture,
-        .x = x + 0.5,
-        .y = y + 0.5,
-        .is_updateable = false,
-        .is_hittable = false,
-        .is_harmless = true,
-        .is_visible = true,
-        .touch_distance = 0.5,
-        .is_touchable = true,
-        .touch = touch_flower,
-        .as.flower = {
-            .is_watered = false,
-            .texture_watered = flower_watered_texture
-        }
-    };
+/* Queue a quad showing the src part (in texture coordinates) of a texture
+ * level, or a solid quad if there is no texture */
+void batch_quad(const Texture *texture, SDL_FRect dest, SDL_FRect src, SDL_Color color) {
+    if (batch.num_quads == batch.max_quads) {
+        batch.max_quads = SDL_max(batch.max_quads * 2, 2 * view.width);
+        batch.vertices = realloc(batch.vertices, batch.max_quads * 4 * sizeof(batch.vertices[0]));
+        batch.indices = realloc(batch.indices, batch.max_quads * 6 * sizeof(batch.indices[0]));
+    }
 
-    todo_left++;
+    /* map the texture coordinates into the atlas */
+    const SDL_FRect *rect = texture ? &texture->atlas_rect : &texture_atlas.white;
+    src = (SDL_FRect){rect->x + src.x * rect->w, rect->y + src.y * rect->h, src.w * rect->w, src.h * rect->h};
+
+    int first = batch.num_quads * 4;
+    SDL_Vertex *quad = &batch.vertices[first];
+    quad[0] = (SDL_Vertex){{dest.x, dest.y}, color, {src.x, src.y}};
+    quad[1] = (SDL_Vertex){{dest.x + dest.w, dest.y}, color, {src.x + src.w, src.y}};
+    quad[2] = (SDL_Vertex){{dest.x + dest.w, dest.y + dest.h}, color, {src.x + src.w, src.y + src.h}};
+    quad[3] = (SDL_Vertex){{dest.x, dest.y + dest.h}, color, {src.x, src.y + src.h}};
+
+    int *indices = &batch.indices[batch.num_quads * 6];
+    indices[0] = first;
+    indices[1] = first + 1;
+    indices[2] = first + 2;
+    indices[3] = first;
+    indices[4] = first + 2;
+    indices[5] = first + 3;
+
+    batch.num_quads++;
 }
 
-void touch_flower(Object *object) {
-    object->is_touchable = false;
-    object->as.flower.is_watered = true;
-    object->texture = object->as.flower.texture_watered;
+void flush_batch(void) {
+    if (batch.num_quads == 0) {
+        return;
+    }
 
-    todo_left--;
+    SDL_RenderGeometry(renderer, texture_atlas.texture, batch.vertices, batch.num_quads * 4,
+                       batch.indices, batch.num_quads * 6);
+    batch.num_quads = 0;
 }
 
-void init_coin(Object *object, int x, int y) {
-    *object = (typeof(*object)) {
-        .texture = coin_texture,
-        .x = x + 0.5,
-        .y = y + 0.5,
-        .is_harmless = true,
-        .is_visible = true,
-        .is_touchable = true,
-        .touch_distance = 0.5,
-        .touch = touch_coin
-    };
+void free_batch(void) {
+    free(batch.vertices);
+    free(batch.indices);
+    batch = (typeof(batch)){0};
 }
 
-void touch_coin(Object *object) {
-    object->is_visible = false;
-    object->is_touchable = false;
-    coins_collected++;
-
+/* The cell of the tile at x, y, which may be a border cell */
+Cell *map_cell(int map_x, int map_y) {
+    return &tile_grid.origin[map_y * tile_grid.stride + map_x];
 }
 
-void update_objects(Uint32 elapsed_time) {
-    /* update  */
-    for (int i = 0; i < num_objects; i++) {
-        if (objects[i].is_updateable && objects[i].update) {
-            objects[i].update(&objects[i], elapsed_time);
+/* Fill the light tables for the fog of the map. Horizontal wall faces are a
+ * bit darker than vertical ones. */
+void build_light_tables(void) {
+    const float face_light[] = {
+        [HIT_NONE] = 1.0f,
+        [HIT_HORIZONTAL] = 235.0f / 255.0f,
+        [HIT_VERTICAL] = 1.0f
+    };
+    const MapFog *fog = &level.fog;
+
+    for (int face = 0; face < 3; face++) {
+        for (int step = 0; step < LIGHT_DISTANCE_STEPS; step++) {
+            float distance = (step + 0.5f) * MAX_DISTANCE / LIGHT_DISTANCE_STEPS;
+            float fogged = 0.0f;
+            if (fog->end > 0.0f) {
+                fogged = SDL_clamp((distance - fog->start) / (fog->end - fog->start), 0.0f, 1.0f);
+            }
+            float lit = face_light[face] * (1.0f - fogged);
+
+            LightLevel *light = &lighting.levels[face][step];
+            Uint8 modulation[3];
+            for (int channel = 0; channel < 3; channel++) {
+                float fog_value = fog->color[channel] * fogged;
+                for (int value = 0; value < 256; value++) {
+                    light->channels[channel][value] = (Uint8)(value * lit + fog_value + 0.5f);
+                }
+                modulation[channel] = (Uint8)SDL_min(255.0f * lit + fog_value, 255.0f);
+            }
+            light->modulation = (SDL_Color){modulation[0], modulation[1], modulation[2], 255};
         }
     }
 
-    /* touch */
-    for (int i = 0; i < num_objects; i++) {
-        if (!objects[i].is_touchable) {
-            continue;
-        }
+    build_row_colors();
+}
 
-        float distance_to_object = sqrtf(powf(objects[i].x - player.x, 2) + powf(objects[i].y - player.y, 2));
-        if (distance_to_object > objects[i].touch_distance) {
-            continue;
-        }
+/* Light the flat floor and ceiling of the SDL backend for the view rows: a
+ * row is as far away as a wall reaching down or up to it would be */
+void build_row_colors(void) {
+    for (int y = 0; y < view.height; y++) {
+        Uint32 color = y < view.height / 2 ? 0xFFFFFF : 0x808080;
+        float rows_from_horizon = fabsf(y + 0.5f - view.height / 2);
+        const LightLevel *light = light_level(HIT_NONE, view.height / 2 / rows_from_horizon);
+        lighting.row_colors[y] = 0xFF000000 |
+            light->channels[0][color >> 16 & 0xFF] << 16 |
+            light->channels[1][color >> 8 & 0xFF] << 8 |
+            light->channels[2][color & 0xFF];
+    }
+}
 
-        assert(objects[i].touch);
+/* The light of a face at the given distance */
+const LightLevel *light_level(wall_collision_result_t face, float distance) {
+    int step = (int)(distance * (LIGHT_DISTANCE_STEPS / MAX_DISTANCE));
+    return &lighting.levels[face][SDL_clamp(step, 0, LIGHT_DISTANCE_STEPS - 1)];
+}
 
-        objects[i].touch(&objects[i]);
+/* Rays are spread evenly over the FOV, one per view column */
+void build_camera_tables(void) {
+    const float angle_per_ray = (FOV / (float)view.width);
+    for (int i = 0; i < view.width; i++) {
+        float column_angle = -FOV / 2.0 + i * angle_per_ray;
+        camera.column_cos[i] = cosf(column_angle);
+        camera.column_sin[i] = sinf(column_angle);
+        camera.column_tan[i] = tanf(column_angle);
     }
 
+    camera.tan_half_fov = tanf(FOV / 2);
+    camera.projection = (view.width / 2) / camera.tan_half_fov;
 }
 
-void init_door(Object *object, int x, int y) {
-    *object = (typeof(*object)) {
-        .texture = NULL,        /* do not render */
-        .x = x + 0.5,
-        .y = y + 0.5,
-        .hit_distance = 0.6f,
-        .is_updateable = false,
-        .is_hittable = true,
-        .is_harmless = true,
-        .is_visible = false,
+/* Place the camera alpha of the way from the player of the previous tick to
+ * the current one */
+void update_camera(float alpha) {
+    /* turn the short way round when the direction wraps */
+    float turn = player.direction - previous_player.direction;
+    if (turn > M_PI) {
+        turn -= 2 * M_PI;
+    } else if (turn < -M_PI) {
+        turn += 2 * M_PI;
+    }
+    float direction = previous_player.direction + turn * alpha;
 
-        .hit = door_hit,
-        .update = door_update,
+    camera.x = previous_player.x + (player.x - previous_player.x) * alpha;
+    camera.y = previous_player.y + (player.y - previous_player.y) * alpha;
+    camera.alpha = alpha;
+    camera.direction = (Vector2){cosf(direction), sinf(direction)};
+}
 
-        .as.door = {
-            .is_open = false,
-            .is_opening = false,
-            .door_width = 1.0f
-        }
+/* Direction of the ray cast for the given screen column: the view direction
+ * rotated by the column angle */
+Vector2 ray_direction(int col) {
+    float c = camera.column_cos[col];
+    float s = camera.column_sin[col];
+    return (Vector2){
+        camera.direction.x * c - camera.direction.y * s,
+        camera.direction.y * c + camera.direction.x * s
     };
 }
 
-void door_hit(Object *object) {
-    if (!object->as.door.is_open || !object->as.door.is_opening) {
-        object->is_updateable = true;
-        object->as.door.is_opening = true;
+/* Cast rays for columns [col_start, col_end) into ray_hits using the selected
+ * ray caster. Columns that do not fill a whole packet go through the scalar
+ * one. */
+void cast_rays(int col_start, int col_end) {
+    int col = col_start;
 
-        Mix_PlayChannel(-1, door_sound, 0);
+#ifdef HAVE_PACKET_RAYCASTER
+    if (raycaster == RAYCASTER_AVX2) {
+        for (; col + 8 <= col_end; col += 8) {
+            cast_ray_packet_avx2(col, &ray_hits[col]);
+        }
+    } else if (raycaster == RAYCASTER_SSE2) {
+        for (; col + 4 <= col_end; col += 4) {
+            cast_ray_packet_sse2(col, &ray_hits[col]);
+        }
     }
-}
+#endif
 
-void door_update(Object *object, Uint32 elapsed_time) {
-    if (!object->as.door.is_opening) {
-        return;
+    for (; col < col_end; col++) {
+        cast_ray(ray_direction(col), &ray_hits[col]);
     }
-    float diff = elapsed_time * 0.002f;
-    object->as.door.door_width -= diff;
-    if (object->as.door.door_width <= 0.0f) {
-        object->as.door.is_open = true;
-        object->as.door.is_opening = false;
-        object->is_updateable = false;
-        object->is_hittable = false;
-        object->as.door.door_width = 0.0f;
+
+    /* diff the results against the scalar ray caster */
+    if (raycaster_check && raycaster != RAYCASTER_SCALAR) {
+        for (col = col_start; col < col_end; col++) {
+            RayHit expected;
+            cast_ray(ray_direction(col), &expected);
+
+            RayHit *hit = &ray_hits[col];
+            if (hit->distance != expected.distance || hit->tex_offset != expected.tex_offset ||
+                hit->texture != expected.texture || hit->collision != expected.collision) {
+                fprintf(stderr, "Ray caster mismatch at column %d: %f %f %d %d, expected %f %f %d %d\n",
+                        col, hit->distance, hit->tex_offset, hit->texture, hit->collision,
+                        expected.distance, expected.tex_offset, expected.texture, expected.collision);
+            }
+        }
     }
 }
 
-int compare_objects_by_distance(const void *left, const void *right) {
-    float left_distance = (*(Object **)left)->distance_to_player;
-    float right_distance = (*(Object **)right)->distance_to_player;
-    return left_distance < right_distance ? 1 : -1;
-}
+/* Cast a ray from the camera position using a grid traversal (DDA): only the
+ * tiles actually crossed by the ray are visited and the distance to the hit is
+ * exact, since the ray advances from one tile boundary to the next. Doors are
+ * intersected analytically with their middle plane. */
+void cast_ray(Vector2 direction, RayHit *hit) {
+    int map_x = (int)floorf(camera.x);
+    int map_y = (int)floorf(camera.y);
+
+    /* distance along the ray between two vertical (x) or horizontal (y) grid
+     * lines */
+    float delta_x = direction.x == 0.0f ? FLT_MAX : fabsf(1.0f / direction.x);
+    float delta_y = direction.y == 0.0f ? FLT_MAX : fabsf(1.0f / direction.y);
+
+    /* distance along the ray to the next vertical/horizontal grid line */
+    int step_x, step_y;
+    float side_x, side_y;
+    if (direction.x < 0) {
+        step_x = -1;
+        side_x = (camera.x - map_x) * delta_x;
+    } else {
+        step_x = 1;
+        side_x = (map_x + 1.0f - camera.x) * delta_x;
+    }
+    if (direction.y < 0) {
+        step_y = -1;
+        side_y = (camera.y - map_y) * delta_y;
+    } else {
+        step_y = 1;
+        side_y = (map_y + 1.0f - camera.y) * delta_y;
+    }
 
-Object *objects_visible[MAX_OBJECTS] = {0};
+    *hit = (RayHit) {
+        .distance = MAX_DISTANCE,
+        .tex_offset = 0.0f,
+        .texture = WALL_TEXTURE_WALL,
+        .collision = HIT_NONE
+    };
 
-void render_sprites(void) {
-    /* Collect sprites that are visible and qsort them based on line height (aka
-     * distance). This'll solve the sprite overlapping problem. */
+    /* the player might be standing in a door tile, check the door plane before
+     * leaving it */
+    if ((map_cell(map_x, map_y)->flags & CELL_DOOR) &&
+        is_ray_hit(map_x, map_y, direction, 0.0f, HIT_NONE, hit)) {
+        return;
+    }
 
-    int num_objects_visible = 0;
-    for (int i = 0; i < num_objects; i++) {
-        if (!objects[i].is_visible) {
-            continue;
+    float distance = 0.0f;
+    while (distance < MAX_DISTANCE) {
+        /* jump to the closest grid line, crossing a vertical line means
+         * hitting a vertical wall face and vice versa */
+        wall_collision_result_t side;
+        if (side_x < side_y) {
+            distance = side_x;
+            side_x += delta_x;
+            map_x += step_x;
+            side = HIT_VERTICAL;
+        } else {
+            distance = side_y;
+            side_y += delta_y;
+            map_y += step_y;
+            side = HIT_HORIZONTAL;
         }
 
-        /* Angle between a player space positive x-axis and sprite positiion */
-        float angle = atan2f(objects[i].y - player.y, objects[i].x - player.x);
-
-        /* Find the angle between player's direction vector and the object and
-         * normalize it */
-        float relative_angle = player.direction - angle;
-        if (relative_angle > M_PI) {
-            relative_angle -= 2 * M_PI;
+        if (is_ray_hit(map_x, map_y, direction, distance, side, hit)) {
+            return;
         }
+    }
 
-        /* Check if the object is in the player's field of view */
-        if (relative_angle < -FOV / 2.0 || relative_angle > FOV / 2.0) {
-            continue;
+    hit->distance = MAX_DISTANCE;
+}
+
+/* Check if a ray that has just entered the given tile through a grid line
+ * (side) at the given distance stops there. Fills the hit if it does. */
+bool is_ray_hit(int map_x, int map_y, Vector2 direction, float distance, wall_collision_result_t side, RayHit *hit) {
+    /* the only memory access for empty tiles, the border cells outside of the
+     * map are solid */
+    const Cell *cell = map_cell(map_x, map_y);
+
+    if (cell->flags & CELL_SOLID) {
+        /* texture offset is the position of the hit along the wall face */
+        float position = side == HIT_VERTICAL ?
+            camera.y + direction.y * distance :
+            camera.x + direction.x * distance;
+
+        hit->distance = distance;
+        hit->tex_offset = position - floorf(position);
+        hit->texture = cell->texture;
+        hit->collision = side;
+        return true;
+    }
+
+    if ((cell->flags & CELL_DOOR) &&
+        is_door_ray_collision(map_x, map_y, cell, direction, &hit->distance, &hit->tex_offset)) {
+        hit->texture = cell->texture;
+        hit->collision = cell->flags & CELL_HORIZONTAL ? HIT_HORIZONTAL : HIT_VERTICAL;
+        return true;
+    }
+
+    return false;
+}
+
+#ifdef HAVE_PACKET_RAYCASTER
+
+/* Packet ray casters: the same grid traversal as cast_ray, but advancing 4
+ * (SSE2) or 8 (AVX2) adjacent rays in lockstep, each lane stepping to its own
+ * next grid line. Each lane also tracks the index of its cell in the tile
+ * grid, the flags of the entered cells are gathered (AVX2) or loaded lane by
+ * lane (SSE2 has no gather), and only lanes that entered a wall or door go
+ * through is_ray_hit for the hit itself. Lanes that have hit something are
+ * masked out until the whole packet is done. Results are identical to
+ * cast_ray's. */
+
+__attribute__((target("sse2")))
+__m128 packet_select_sse2(__m128 mask, __m128 a, __m128 b) {
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__attribute__((target("sse2")))
+void cast_ray_packet_sse2(int col, RayHit *hits) {
+    const int map_x = (int)floorf(camera.x);
+    const int map_y = (int)floorf(camera.y);
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 pos_x = _mm_set1_ps(camera.x);
+    const __m128 pos_y = _mm_set1_ps(camera.y);
+    const __m128 tile_x = _mm_set1_ps((float)map_x);
+    const __m128 tile_y = _mm_set1_ps((float)map_y);
+
+    /* rotate the view direction by the column angles, see ray_direction */
+    const __m128 view_x = _mm_set1_ps(camera.direction.x);
+    const __m128 view_y = _mm_set1_ps(camera.direction.y);
+    const __m128 column_cos = _mm_loadu_ps(&camera.column_cos[col]);
+    const __m128 column_sin = _mm_loadu_ps(&camera.column_sin[col]);
+    const __m128 dir_x = _mm_sub_ps(_mm_mul_ps(view_x, column_cos), _mm_mul_ps(view_y, column_sin));
+    const __m128 dir_y = _mm_add_ps(_mm_mul_ps(view_y, column_cos), _mm_mul_ps(view_x, column_sin));
+
+    /* lane directions for the tile checks */
+    Vector2 directions[4];
+    float dirs_x[4], dirs_y[4];
+    _mm_storeu_ps(dirs_x, dir_x);
+    _mm_storeu_ps(dirs_y, dir_y);
+    for (int lane = 0; lane < 4; lane++) {
+        directions[lane] = (Vector2){dirs_x[lane], dirs_y[lane]};
+    }
+
+    /* distance between grid lines */
+    const __m128 delta_x = packet_select_sse2(_mm_cmpeq_ps(dir_x, zero), _mm_set1_ps(FLT_MAX),
+                                              _mm_and_ps(_mm_div_ps(one, dir_x), abs_mask));
+    const __m128 delta_y = packet_select_sse2(_mm_cmpeq_ps(dir_y, zero), _mm_set1_ps(FLT_MAX),
+                                              _mm_and_ps(_mm_div_ps(one, dir_y), abs_mask));
+
+    /* steps are -1 (all bits set) for negative directions, 1 otherwise */
+    const __m128 negative_x = _mm_cmplt_ps(dir_x, zero);
+    const __m128 negative_y = _mm_cmplt_ps(dir_y, zero);
+    const __m128i step_x = _mm_or_si128(_mm_castps_si128(negative_x),
+                                        _mm_andnot_si128(_mm_castps_si128(negative_x), _mm_set1_epi32(1)));
+    const __m128i step_y = _mm_or_si128(_mm_castps_si128(negative_y),
+                                        _mm_andnot_si128(_mm_castps_si128(negative_y), _mm_set1_epi32(1)));
+
+    /* distance to the next grid line */
+    __m128 side_x = _mm_mul_ps(packet_select_sse2(negative_x, _mm_sub_ps(pos_x, tile_x),
+                                                  _mm_sub_ps(_mm_add_ps(tile_x, one), pos_x)), delta_x);
+    __m128 side_y = _mm_mul_ps(packet_select_sse2(negative_y, _mm_sub_ps(pos_y, tile_y),
+                                                  _mm_sub_ps(_mm_add_ps(tile_y, one), pos_y)), delta_y);
+
+    /* index of the lane cells from the tile grid origin, a y step moves a
+     * whole row */
+    const __m128i stride = _mm_set1_epi32(tile_grid.stride);
+    const __m128i step_y_cells = _mm_or_si128(_mm_and_si128(_mm_castps_si128(negative_y), _mm_sub_epi32(_mm_setzero_si128(), stride)),
+                                              _mm_andnot_si128(_mm_castps_si128(negative_y), stride));
+
+    __m128i lane_x = _mm_set1_epi32(map_x);
+    __m128i lane_y = _mm_set1_epi32(map_y);
+    __m128i lane_cell = _mm_set1_epi32(map_y * tile_grid.stride + map_x);
+    __m128 distance = zero;
+    const __m128 max_distance = _mm_set1_ps(MAX_DISTANCE);
+
+    int active = 0xF;
+    for (int lane = 0; lane < 4; lane++) {
+        hits[lane] = (RayHit) {
+            .distance = MAX_DISTANCE,
+            .tex_offset = 0.0f,
+            .texture = WALL_TEXTURE_WALL,
+            .collision = HIT_NONE
+        };
+    }
+
+    /* the player might be standing in a door tile */
+    if (map_cell(map_x, map_y)->flags & CELL_DOOR) {
+        for (int lane = 0; lane < 4; lane++) {
+            if (is_ray_hit(map_x, map_y, directions[lane], 0.0f, HIT_NONE, &hits[lane])) {
+                active &= ~(1 << lane);
+            }
+        }
+    }
+
+    const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+    while (active) {
+        __m128i active_bits = _mm_and_si128(_mm_set1_epi32(active), lane_bits);
+        __m128 active_mask = _mm_castsi128_ps(_mm_cmpeq_epi32(active_bits, lane_bits));
+
+        /* jump to the closest grid line */
+        __m128 in_x = _mm_cmplt_ps(side_x, side_y);
+        __m128 step_in_x = _mm_and_ps(active_mask, in_x);
+        __m128 step_in_y = _mm_andnot_ps(in_x, active_mask);
+
+        distance = packet_select_sse2(active_mask, packet_select_sse2(in_x, side_x, side_y), distance);
+        side_x = _mm_add_ps(side_x, _mm_and_ps(step_in_x, delta_x));
+        side_y = _mm_add_ps(side_y, _mm_and_ps(step_in_y, delta_y));
+        lane_x = _mm_add_epi32(lane_x, _mm_and_si128(_mm_castps_si128(step_in_x), step_x));
+        lane_y = _mm_add_epi32(lane_y, _mm_and_si128(_mm_castps_si128(step_in_y), step_y));
+        lane_cell = _mm_add_epi32(lane_cell, _mm_or_si128(_mm_and_si128(_mm_castps_si128(step_in_x), step_x),
+                                                          _mm_and_si128(_mm_castps_si128(step_in_y), step_y_cells)));
+
+        /* look up the cells entered by the active lanes, most are empty */
+        int cells[4];
+        _mm_storeu_si128((__m128i *)cells, lane_cell);
+        int blocked = 0;
+        for (int lane = 0; lane < 4; lane++) {
+            if ((active & (1 << lane)) && (tile_grid.origin[cells[lane]].flags & (CELL_SOLID | CELL_DOOR))) {
+                blocked |= 1 << lane;
+            }
+        }
+        int far = _mm_movemask_ps(_mm_cmpge_ps(distance, max_distance)) & active;
+
+        /* find the hits of the lanes in walls and doors */
+        if (blocked) {
+            int tiles_x[4], tiles_y[4];
+            float distances[4];
+            _mm_storeu_si128((__m128i *)tiles_x, lane_x);
+            _mm_storeu_si128((__m128i *)tiles_y, lane_y);
+            _mm_storeu_ps(distances, distance);
+            int x_steps = _mm_movemask_ps(in_x);
+
+            for (int lane = 0; lane < 4; lane++) {
+                if (!(blocked & (1 << lane))) {
+                    continue;
+                }
+
+                wall_collision_result_t side = x_steps & (1 << lane) ? HIT_VERTICAL : HIT_HORIZONTAL;
+                if (is_ray_hit(tiles_x[lane], tiles_y[lane], directions[lane], distances[lane], side, &hits[lane])) {
+                    active &= ~(1 << lane);
+                }
+            }
+        }
+        active &= ~far;
+    }
+}
+
+__attribute__((target("avx2")))
+void cast_ray_packet_avx2(int col, RayHit *hits) {
+    const int map_x = (int)floorf(camera.x);
+    const int map_y = (int)floorf(camera.y);
+
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+    const __m256 pos_x = _mm256_set1_ps(camera.x);
+    const __m256 pos_y = _mm256_set1_ps(camera.y);
+    const __m256 tile_x = _mm256_set1_ps((float)map_x);
+    const __m256 tile_y = _mm256_set1_ps((float)map_y);
+
+    /* rotate the view direction by the column angles, see ray_direction */
+    const __m256 view_x = _mm256_set1_ps(camera.direction.x);
+    const __m256 view_y = _mm256_set1_ps(camera.direction.y);
+    const __m256 column_cos = _mm256_loadu_ps(&camera.column_cos[col]);
+    const __m256 column_sin = _mm256_loadu_ps(&camera.column_sin[col]);
+    const __m256 dir_x = _mm256_sub_ps(_mm256_mul_ps(view_x, column_cos), _mm256_mul_ps(view_y, column_sin));
+    const __m256 dir_y = _mm256_add_ps(_mm256_mul_ps(view_y, column_cos), _mm256_mul_ps(view_x, column_sin));
+
+    /* lane directions for the tile checks */
+    Vector2 directions[8];
+    float dirs_x[8], dirs_y[8];
+    _mm256_storeu_ps(dirs_x, dir_x);
+    _mm256_storeu_ps(dirs_y, dir_y);
+    for (int lane = 0; lane < 8; lane++) {
+        directions[lane] = (Vector2){dirs_x[lane], dirs_y[lane]};
+    }
+
+    /* distance between grid lines */
+    const __m256 delta_x = _mm256_blendv_ps(_mm256_and_ps(_mm256_div_ps(one, dir_x), abs_mask),
+                                            _mm256_set1_ps(FLT_MAX), _mm256_cmp_ps(dir_x, zero, _CMP_EQ_OQ));
+    const __m256 delta_y = _mm256_blendv_ps(_mm256_and_ps(_mm256_div_ps(one, dir_y), abs_mask),
+                                            _mm256_set1_ps(FLT_MAX), _mm256_cmp_ps(dir_y, zero, _CMP_EQ_OQ));
+
+    /* steps are -1 (all bits set) for negative directions, 1 otherwise */
+    const __m256 negative_x = _mm256_cmp_ps(dir_x, zero, _CMP_LT_OQ);
+    const __m256 negative_y = _mm256_cmp_ps(dir_y, zero, _CMP_LT_OQ);
+    const __m256i step_x = _mm256_or_si256(_mm256_castps_si256(negative_x),
+                                           _mm256_andnot_si256(_mm256_castps_si256(negative_x), _mm256_set1_epi32(1)));
+    const __m256i step_y = _mm256_or_si256(_mm256_castps_si256(negative_y),
+                                           _mm256_andnot_si256(_mm256_castps_si256(negative_y), _mm256_set1_epi32(1)));
+
+    /* distance to the next grid line */
+    __m256 side_x = _mm256_mul_ps(_mm256_blendv_ps(_mm256_sub_ps(_mm256_add_ps(tile_x, one), pos_x),
+                                                   _mm256_sub_ps(pos_x, tile_x), negative_x), delta_x);
+    __m256 side_y = _mm256_mul_ps(_mm256_blendv_ps(_mm256_sub_ps(_mm256_add_ps(tile_y, one), pos_y),
+                                                   _mm256_sub_ps(pos_y, tile_y), negative_y), delta_y);
+
+    /* index of the lane cells from the tile grid origin, a y step moves a
+     * whole row */
+    const __m256i step_y_cells = _mm256_mullo_epi32(step_y, _mm256_set1_epi32(tile_grid.stride));
+
+    __m256i lane_x = _mm256_set1_epi32(map_x);
+    __m256i lane_y = _mm256_set1_epi32(map_y);
+    __m256i lane_cell = _mm256_set1_epi32(map_y * tile_grid.stride + map_x);
+    __m256 distance = zero;
+    const __m256 max_distance = _mm256_set1_ps(MAX_DISTANCE);
+    const __m256i blocking_flags = _mm256_set1_epi32(CELL_SOLID | CELL_DOOR);
+
+    int active = 0xFF;
+    for (int lane = 0; lane < 8; lane++) {
+        hits[lane] = (RayHit) {
+            .distance = MAX_DISTANCE,
+            .tex_offset = 0.0f,
+            .texture = WALL_TEXTURE_WALL,
+            .collision = HIT_NONE
+        };
+    }
+
+    /* the player might be standing in a door tile */
+    if (map_cell(map_x, map_y)->flags & CELL_DOOR) {
+        for (int lane = 0; lane < 8; lane++) {
+            if (is_ray_hit(map_x, map_y, directions[lane], 0.0f, HIT_NONE, &hits[lane])) {
+                active &= ~(1 << lane);
+            }
+        }
+    }
+
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    while (active) {
+        __m256i active_bits = _mm256_and_si256(_mm256_set1_epi32(active), lane_bits);
+        __m256 active_mask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(active_bits, lane_bits));
+
+        /* jump to the closest grid line */
+        __m256 in_x = _mm256_cmp_ps(side_x, side_y, _CMP_LT_OQ);
+        __m256 step_in_x = _mm256_and_ps(active_mask, in_x);
+        __m256 step_in_y = _mm256_andnot_ps(in_x, active_mask);
+
+        distance = _mm256_blendv_ps(distance, _mm256_blendv_ps(side_y, side_x, in_x), active_mask);
+        side_x = _mm256_add_ps(side_x, _mm256_and_ps(step_in_x, delta_x));
+        side_y = _mm256_add_ps(side_y, _mm256_and_ps(step_in_y, delta_y));
+        lane_x = _mm256_add_epi32(lane_x, _mm256_and_si256(_mm256_castps_si256(step_in_x), step_x));
+        lane_y = _mm256_add_epi32(lane_y, _mm256_and_si256(_mm256_castps_si256(step_in_y), step_y));
+        lane_cell = _mm256_add_epi32(lane_cell, _mm256_or_si256(_mm256_and_si256(_mm256_castps_si256(step_in_x), step_x),
+                                                                _mm256_and_si256(_mm256_castps_si256(step_in_y), step_y_cells)));
+
+        /* gather the first word of the cells entered by the active lanes, the
+         * flags are its low byte */
+        __m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int *)tile_grid.origin, lane_cell,
+                                                    _mm256_castps_si256(active_mask), sizeof(Cell));
+        __m256i open = _mm256_cmpeq_epi32(_mm256_and_si256(words, blocking_flags), _mm256_setzero_si256());
+        int blocked = ~_mm256_movemask_ps(_mm256_castsi256_ps(open)) & active;
+        int far = _mm256_movemask_ps(_mm256_cmp_ps(distance, max_distance, _CMP_GE_OQ)) & active;
+
+        /* find the hits of the lanes in walls and doors */
+        if (blocked) {
+            int tiles_x[8], tiles_y[8];
+            float distances[8];
+            _mm256_storeu_si256((__m256i *)tiles_x, lane_x);
+            _mm256_storeu_si256((__m256i *)tiles_y, lane_y);
+            _mm256_storeu_ps(distances, distance);
+            int x_steps = _mm256_movemask_ps(in_x);
+
+            for (int lane = 0; lane < 8; lane++) {
+                if (!(blocked & (1 << lane))) {
+                    continue;
+                }
+
+                wall_collision_result_t side = x_steps & (1 << lane) ? HIT_VERTICAL : HIT_HORIZONTAL;
+                if (is_ray_hit(tiles_x[lane], tiles_y[lane], directions[lane], distances[lane], side, &hits[lane])) {
+                    active &= ~(1 << lane);
+                }
+            }
+        }
+        active &= ~far;
+    }
+}
+
+#endif /* HAVE_PACKET_RAYCASTER */
+
+/* Intersect a ray from the player position with the middle plane of the door
+ * in the given tile. Only the part of the door that is still closed (see
+ * door_width) can be hit. */
+bool is_door_ray_collision(int map_x, int map_y, const Cell *cell, Vector2 direction, float *distance, float *tex_offset) {
+    float door_width = objects.state[level.door_objects[cell->door]].as.door.door_width;
+
+    /* horizontal door, the plane is the tile's horisontal middle line */
+    if (cell->flags & CELL_HORIZONTAL) {
+        if (direction.y == 0.0f) {
+            return false;
+        }
+
+        float plane_distance = (map_y + 0.5f - camera.y) / direction.y;
+        if (plane_distance < 0.0f) {
+            return false;
+        }
+
+        /* the ray might cross the middle line outside of the tile */
+        float x_diff = camera.x + direction.x * plane_distance - map_x;
+        if (x_diff < 0.0f || x_diff >= 1.0f || x_diff >= door_width) {
+            return false;
+        }
+
+        *distance = plane_distance;
+        *tex_offset = 1 - door_width + x_diff;
+        return true;
+    }
+
+    /* vertical door, the plane is the tile's vertical middle line */
+    if (direction.x == 0.0f) {
+        return false;
+    }
+
+    float plane_distance = (map_x + 0.5f - camera.x) / direction.x;
+    if (plane_distance < 0.0f) {
+        return false;
+    }
+
+    float y_diff = camera.y + direction.y * plane_distance - map_y;
+    if (y_diff < 0.0f || y_diff >= 1.0f || y_diff >= door_width) {
+        return false;
+    }
+
+    *distance = plane_distance;
+    *tex_offset = 1 - door_width + y_diff;
+    return true;
+}
+
+bool is_move_collision(float x, float y) {
+    float offset = 0.0f;
+    return is_wall_collision(x, y, &offset) ||
+        is_door_collision(x, y, &offset, true);
+}
+
+bool is_door_collision(float x, float y, float *tex_offset, bool check_if_open) {
+    const Cell *cell = map_cell((int)floorf(x), (int)floorf(y));
+
+    /* check if the tile is right */
+    if (!(cell->flags & CELL_DOOR)) {
+        return false;
+    }
+
+    ObjectState *door_state = &objects.state[level.door_objects[cell->door]];
+    float door_width = door_state->as.door.door_width;
+
+    /* for movememnt purposes closed and partially closed doors are not transparent */
+    if (check_if_open && !door_state->as.door.is_open) {
+        return true;
+    }
+
+    /* horizontal door */
+    if (cell->flags & CELL_HORIZONTAL) {
+        /* distance to door tile horisontal middle line */
+        float y_diff = fabs(fabs(roundf(y) - y) - 0.5);
+
+        /* door width is 0.02 x 2 */
+        if (y_diff >= 0.02f) {
+            return false;
+        }
+
+        /* check if we hit a partially open door */
+        float x_diff = x - floorf(x);
+        if (x_diff < door_width) {
+            *tex_offset = 1 - door_width + x_diff;
+            return true;
+        }
+
+        return false;
+    }
+
+    /* vertical door */
+    /* distance to door tile vertical middle line */
+    float x_diff = fabs(fabs(roundf(x) - x) - 0.5);
+
+    /* door width is 0.02 x 2 */
+    if (x_diff >= 0.02f) {
+        return false;
+    }
+
+    /* check if we hit a partially open door */
+    float y_diff = y - floorf(y);
+    if (y_diff < door_width) {
+        *tex_offset = 1 - door_width + y_diff;
+        return true;
+    }
+
+    return false;
+}
+
+wall_collision_result_t is_wall_collision(float x, float y, float *tex_offset) {
+    /* out of bounds counts as wall: border cells are solid */
+    const Cell *cell = map_cell((int)floorf(x), (int)floorf(y));
+    if (!(cell->flags & CELL_SOLID)) {
+        return HIT_NONE;
+    }
+
+    /* check if horisontal or vertical wall, find texture offset accordingly */
+    wall_collision_result_t result;
+    if (fabs(roundf(x) - x) >= fabs(roundf(y) - y)) {
+        result = HIT_HORIZONTAL;
+        *tex_offset = x - floorf(x);
+    } else {
+        result = HIT_VERTICAL;
+        *tex_offset = y - floorf(y);
+    }
+
+    return result;
+}
+
+/* Behaviour of every object kind, callbacks may be NULL */
+const ObjectKind object_kinds[OBJECT_KIND_COUNT] = {
+    [OBJECT_PROJECTILE] = {.update = projectile_update},
+    [OBJECT_POO] = {.hit = poo_hit, .touch = poo_touch},
+    [OBJECT_FLY] = {.update = fly_update, .hit = fly_hit, .touch = fly_touch},
+    [OBJECT_FLOWER] = {.touch = touch_flower},
+    [OBJECT_COIN] = {.touch = touch_coin},
+    [OBJECT_DOOR] = {.update = door_update, .hit = door_hit}
+};
+
+/* Set up the hot fields of a new object, the cold state is reset */
+void init_object(int object, object_kind_t kind, float x, float y, Uint8 flags, Texture *texture) {
+    objects.x[object] = x;
+    objects.y[object] = y;
+    objects.prev_x[object] = x;
+    objects.prev_y[object] = y;
+    objects.flags[object] = flags;
+    objects.kind[object] = kind;
+    objects.hit_distance[object] = 0.0f;
+    objects.touch_distance[object] = 0.0f;
+    objects.state[object] = (ObjectState){.texture = texture};
+}
+
+bool has_no_things_to_do() {
+    for (int i = 0; i < num_objects; i++) {
+        if (!(objects.flags[i] & OBJECT_HARMLESS)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void init_poo(int object, int x, int y) {
+    init_object(object, OBJECT_POO, x + 0.5, y + 0.5,
+                OBJECT_UPDATEABLE | OBJECT_HITTABLE | OBJECT_VISIBLE | OBJECT_TOUCHABLE,
+                &poo_texture);
+    objects.touch_distance[object] = 0.5;
+    objects.hit_distance[object] = 0.5;
+
+    todo_left++;
+}
+
+void poo_hit(int object) {
+    destroy_object(object);
+
+    todo_left--;
+}
+
+void poo_touch(int object) {
+    if (coins_collected)
+        coins_collected--;
+
+    poo_hit(object);
+
+    Mix_PlayChannel(-1, pain_sound, 0);
+}
+
+void init_fly(int object, int x, int y) {
+    init_object(object, OBJECT_FLY, x + 0.5, y + 0.5,
+                OBJECT_UPDATEABLE | OBJECT_VISIBLE | OBJECT_HITTABLE | OBJECT_TOUCHABLE,
+                &fly_texture);
+    objects.hit_distance[object] = 0.25;
+    objects.touch_distance[object] = 0.25;
+
+    todo_left++;
+}
+
+void fly_hit(int object) {
+    destroy_object(object);
+
+    todo_left--;
+}
+
+void fly_touch(int object) {
+    if (coins_collected)
+        coins_collected--;
+
+    fly_hit(object);
+
+    Mix_PlayChannel(-1, pain_sound, 0);
+}
+
+void init_projectile(int object) {
+    init_object(object, OBJECT_PROJECTILE, 0.0f, 0.0f, OBJECT_HARMLESS, &brush_texture);
+}
+
+void projectile_update(int projectile, float elapsed_time) {
+    Vector2 direction = objects.state[projectile].direction;
+    float dx = direction.x * PROJECTILE_SPEED * elapsed_time;
+    float dy = direction.y * PROJECTILE_SPEED * elapsed_time;
+
+    float old_x = objects.x[projectile];
+    float old_y = objects.y[projectile];
+    float new_x = old_x + dx;
+    float new_y = old_y + dy;
+
+    if (is_move_collision(new_x, new_y)) {
+        goto remove_projectile;
+    }
+
+    /* move the project to the new position */
+    move_object(projectile, new_x, new_y);
+
+    /* check objects near the path travelled this frame, so that a fast
+     * projectile does not jump over them */
+    int num_nearby = query_objects_along_ray(old_x, old_y, new_x, new_y, MAX_INTERACTION_DISTANCE, objects.nearby, num_objects);
+    for (int j = 0; j < num_nearby; j++) {
+        int object = objects.nearby[j];
+
+        /* skip the projectile itself */
+        if (object == projectile || !(objects.flags[object] & OBJECT_HITTABLE)) {
+            continue;
+        }
+
+        float distance = distance_to_segment(objects.x[object], objects.y[object], old_x, old_y, new_x, new_y);
+        if (distance < objects.hit_distance[object]) {
+            object_kinds[objects.kind[object]].hit(object);
+
+            Mix_PlayChannel(-1, brush_sound, 0);
+
+            goto remove_projectile;
+        }
+    }
+    return;
+
+remove_projectile:
+    objects.flags[projectile] &= ~(OBJECT_VISIBLE | OBJECT_UPDATEABLE);
+}
+
+void seed_random(Uint64 seed) {
+    /* xorshift gets stuck at 0, splitmix64 spreads the seed over the state
+     * instead */
+    Uint64 z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    rng.state = (z ^ (z >> 31)) | 1;
+}
+
+Uint32 random_next(void) {
+    rng.state ^= rng.state >> 12;
+    rng.state ^= rng.state << 25;
+    rng.state ^= rng.state >> 27;
+    return (rng.state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+float random_float(float min, float max) {
+    float scale = (random_next() >> 8) / (float)(1 << 24);
+    return min + scale * (max - min);
+}
+
+void fly_update(int object, float elapsed_time) {
+    /* Speed factor*/
+    const float speed = 0.002f;
+
+    /* random directions */
+    float dx = random_float(-1.0f, 1.0f);
+    float dy = random_float(-1.0f, 1.0f);
+
+    /* Scale the movement by the elapsed time and speed factor */
+    dx *= elapsed_time * speed;
+    dy *= elapsed_time * speed;
+
+    /* Calculate the new position */
+    float new_x = objects.x[object] + dx;
+    float new_y = objects.y[object] + dy;
+
+    /* Check if the new position is within map boundaries and not a wall */
+    int new_tile_x = (int)new_x;
+    int new_tile_y = (int)new_y;
+
+    if (new_tile_x >= 0 && new_tile_x < map_width &&
+        new_tile_y >= 0 && new_tile_y < map_height &&
+        !(map_cell(new_tile_x, new_tile_y)->flags & CELL_SOLID)) {
+
+        move_object(object, new_x, new_y);
+    }
+}
+
+void init_flower(int object, int x, int y) {
+    init_object(object, OBJECT_FLOWER, x + 0.5, y + 0.5,
+                OBJECT_HARMLESS | OBJECT_VISIBLE | OBJECT_TOUCHABLE,
+                &flower_unwatered_texture);
+    objects.touch_distance[object] = 0.5;
+    objects.state[object].as.flower.is_watered = false;
+    objects.state[object].as.flower.texture_watered = &flower_watered_texture;
+
+    todo_left++;
+}
+
+void touch_flower(int object) {
+    ObjectState *state = &objects.state[object];
+
+    objects.flags[object] &= ~OBJECT_TOUCHABLE;
+    state->as.flower.is_watered = true;
+    state->texture = state->as.flower.texture_watered;
+
+    todo_left--;
+}
+
+void init_coin(int object, int x, int y) {
+    init_object(object, OBJECT_COIN, x + 0.5, y + 0.5,
+                OBJECT_HARMLESS | OBJECT_VISIBLE | OBJECT_TOUCHABLE,
+                &coin_texture);
+    objects.touch_distance[object] = 0.5;
+}
+
+void touch_coin(int object) {
+    destroy_object(object);
+    coins_collected++;
+
+}
+
+void update_objects(float elapsed_time) {
+    /* update: only the flags are read for objects that stay still */
+    for (int i = 0; i < num_objects; i++) {
+        if (objects.flags[i] & OBJECT_UPDATEABLE) {
+            void (*update) (int object, float elapsed_time) = object_kinds[objects.kind[i]].update;
+            if (update) {
+                update(i, elapsed_time);
+            }
+        }
+    }
+
+    /* touch */
+    int num_nearby = query_objects_in_range(player.x, player.y, MAX_INTERACTION_DISTANCE, objects.nearby, num_objects);
+    for (int i = 0; i < num_nearby; i++) {
+        int object = objects.nearby[i];
+        if (!(objects.flags[object] & OBJECT_TOUCHABLE)) {
+            continue;
+        }
+
+        float dx = objects.x[object] - player.x;
+        float dy = objects.y[object] - player.y;
+        float distance_to_object = sqrtf(dx * dx + dy * dy);
+        if (distance_to_object > objects.touch_distance[object]) {
+            continue;
+        }
+
+        assert(object_kinds[objects.kind[object]].touch);
+
+        object_kinds[objects.kind[object]].touch(object);
+    }
+
+}
+
+/* Hand out zeroed memory from the arena, which is only ever released as a
+ * whole */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = SDL_max(size, ARENA_BLOCK_SIZE);
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Out of memory allocating %zu bytes\n", size);
+            exit(1);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *memory = (char *)block->data + block->used;
+    block->used += size;
+    memset(memory, 0, size);
+    return memory;
+}
+
+void arena_release(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+/* Make room for at least capacity objects. The arrays are reallocated in the
+ * level arena, so a level wastes at most as much as its final pool size. */
+void grow_objects(int capacity) {
+    if (capacity <= objects.capacity) {
+        return;
+    }
+    capacity = SDL_max(capacity, SDL_max(objects.capacity * 2, 64));
+
+#define GROW_OBJECT_ARRAY(array) do {                                    \
+        void *grown = arena_alloc(&level_arena, capacity * sizeof(*(array))); \
+        if (num_objects > 0) {                                          \
+            memcpy(grown, (array), num_objects * sizeof(*(array)));     \
+        }                                                               \
+        (array) = grown;                                                \
+    } while (0)
+
+    GROW_OBJECT_ARRAY(objects.x);
+    GROW_OBJECT_ARRAY(objects.y);
+    GROW_OBJECT_ARRAY(objects.prev_x);
+    GROW_OBJECT_ARRAY(objects.prev_y);
+    GROW_OBJECT_ARRAY(objects.flags);
+    GROW_OBJECT_ARRAY(objects.kind);
+    GROW_OBJECT_ARRAY(objects.hit_distance);
+    GROW_OBJECT_ARRAY(objects.touch_distance);
+    GROW_OBJECT_ARRAY(objects.grid_cell);
+    GROW_OBJECT_ARRAY(objects.grid_prev);
+    GROW_OBJECT_ARRAY(objects.grid_next);
+    GROW_OBJECT_ARRAY(objects.state);
+
+#undef GROW_OBJECT_ARRAY
+
+    /* scratch space, nothing to keep */
+    objects.nearby = arena_alloc(&level_arena, capacity * sizeof(objects.nearby[0]));
+    objects_visible = arena_alloc(&level_arena, capacity * sizeof(objects_visible[0]));
+
+    objects.capacity = capacity;
+}
+
+/* Take an object out of the pool, reusing destroyed ones first. The object
+ * still needs an init_ call and, once placed, to be put in the object grid. */
+int create_object(void) {
+    if (objects.free_list >= 0) {
+        int object = objects.free_list;
+        objects.free_list = objects.grid_next[object];
+        return object;
+    }
+
+    grow_objects(num_objects + 1);
+    return num_objects++;
+}
+
+/* Return an object to the pool. Free objects are harmless and do nothing, so
+ * passes over all of the objects skip them without checking. */
+void destroy_object(int object) {
+    object_grid_remove(object);
+    objects.flags[object] = OBJECT_HARMLESS;
+    objects.kind[object] = OBJECT_FREE;
+    objects.grid_next[object] = objects.free_list;
+    objects.free_list = object;
+}
+
+/* Object grid: every object is linked into the bucket of the map tile it is
+ * in. Objects outside of the map go to the nearest border tile. */
+int object_grid_cell(float x, float y) {
+    int cell_x = SDL_clamp((int)floorf(x), 0, map_width - 1);
+    int cell_y = SDL_clamp((int)floorf(y), 0, map_height - 1);
+    return cell_y * map_width + cell_x;
+}
+
+void object_grid_insert(int object) {
+    int cell = object_grid_cell(objects.x[object], objects.y[object]);
+
+    objects.grid_cell[object] = cell;
+    objects.grid_prev[object] = -1;
+    objects.grid_next[object] = object_grid.cells[cell];
+    if (objects.grid_next[object] >= 0) {
+        objects.grid_prev[objects.grid_next[object]] = object;
+    }
+    object_grid.cells[cell] = object;
+}
+
+void object_grid_remove(int object) {
+    int prev = objects.grid_prev[object];
+    int next = objects.grid_next[object];
+    if (prev >= 0) {
+        objects.grid_next[prev] = next;
+    } else {
+        object_grid.cells[objects.grid_cell[object]] = next;
+    }
+    if (next >= 0) {
+        objects.grid_prev[next] = prev;
+    }
+}
+
+/* Move an object, relinking it only when it crosses into another tile */
+void move_object(int object, float x, float y) {
+    objects.x[object] = x;
+    objects.y[object] = y;
+
+    if (object_grid_cell(x, y) != objects.grid_cell[object]) {
+        object_grid_remove(object);
+        object_grid_insert(object);
+    }
+}
+
+int compare_objects_by_index(const void *left, const void *right) {
+    int left_object = *(const int *)left;
+    int right_object = *(const int *)right;
+    return (left_object > right_object) - (left_object < right_object);
+}
+
+/* Collect up to max_results objects from the tiles overlapping the box, in
+ * the order they are in the objects arrays. Returns the number of objects
+ * found. */
+int query_objects_in_box(float min_x, float min_y, float max_x, float max_y, int *result, int max_results) {
+    /* objects off the map live in the border tiles */
+    int cell_min_x = SDL_clamp((int)floorf(min_x), 0, map_width - 1);
+    int cell_min_y = SDL_clamp((int)floorf(min_y), 0, map_height - 1);
+    int cell_max_x = SDL_clamp((int)floorf(max_x), 0, map_width - 1);
+    int cell_max_y = SDL_clamp((int)floorf(max_y), 0, map_height - 1);
+
+    int num_results = 0;
+    for (int y = cell_min_y; y <= cell_max_y; y++) {
+        for (int x = cell_min_x; x <= cell_max_x; x++) {
+            int object = object_grid.cells[y * map_width + x];
+            for (; object >= 0 && num_results < max_results; object = objects.grid_next[object]) {
+                result[num_results++] = object;
+            }
+        }
+    }
+
+    /* keep the same order as a scan over all objects would */
+    qsort(result, num_results, sizeof(result[0]), compare_objects_by_index);
+
+    return num_results;
+}
+
+/* Objects in the tiles within radius of x, y */
+int query_objects_in_range(float x, float y, float radius, int *result, int max_results) {
+    return query_objects_in_box(x - radius, y - radius, x + radius, y + radius, result, max_results);
+}
+
+/* Objects in the tiles within radius of the segment from (x0, y0) to (x1,
+ * y1) */
+int query_objects_along_ray(float x0, float y0, float x1, float y1, float radius, int *result, int max_results) {
+    return query_objects_in_box(fminf(x0, x1) - radius, fminf(y0, y1) - radius,
+                                fmaxf(x0, x1) + radius, fmaxf(y0, y1) + radius,
+                                result, max_results);
+}
+
+/* Objects in the tiles covered by the field of view up to MAX_DISTANCE */
+int query_objects_in_view(int *result, int max_results) {
+    /* the edges of the field of view, rotated by half of it either way */
+    const float half_fov_cos = cosf(FOV / 2);
+    const float half_fov_sin = sinf(FOV / 2);
+    Vector2 left = {
+        camera.direction.x * half_fov_cos + camera.direction.y * half_fov_sin,
+        camera.direction.y * half_fov_cos - camera.direction.x * half_fov_sin
+    };
+    Vector2 right = {
+        camera.direction.x * half_fov_cos - camera.direction.y * half_fov_sin,
+        camera.direction.y * half_fov_cos + camera.direction.x * half_fov_sin
+    };
+
+    /* the view is a circular sector, its bounding box goes through the
+     * player, the ends of the edges and the points of the arc furthest along
+     * the axes, for those axis directions that are within the sector */
+    float min_x = camera.x, max_x = camera.x;
+    float min_y = camera.y, max_y = camera.y;
+    Vector2 corners[6] = {left, right};
+    int num_corners = 2;
+    const Vector2 axes[] = {{1.0f, 0.0f}, {0.0f, 1.0f}, {-1.0f, 0.0f}, {0.0f, -1.0f}};
+    for (size_t i = 0; i < sizeof(axes) / sizeof(axes[0]); i++) {
+        if (axes[i].x * camera.direction.x + axes[i].y * camera.direction.y >= half_fov_cos) {
+            corners[num_corners++] = axes[i];
+        }
+    }
+    for (int i = 0; i < num_corners; i++) {
+        float x = camera.x + corners[i].x * MAX_DISTANCE;
+        float y = camera.y + corners[i].y * MAX_DISTANCE;
+        min_x = fminf(min_x, x);
+        max_x = fmaxf(max_x, x);
+        min_y = fminf(min_y, y);
+        max_y = fmaxf(max_y, y);
+    }
+
+    return query_objects_in_box(min_x, min_y, max_x, max_y, result, max_results);
+}
+
+/* Distance from the point to the segment from (x0, y0) to (x1, y1) */
+float distance_to_segment(float x, float y, float x0, float y0, float x1, float y1) {
+    float dx = x1 - x0;
+    float dy = y1 - y0;
+    float length_squared = dx * dx + dy * dy;
+    float t = length_squared > 0.0f ? ((x - x0) * dx + (y - y0) * dy) / length_squared : 0.0f;
+    t = SDL_clamp(t, 0.0f, 1.0f);
+
+    float closest_x = x0 + t * dx - x;
+    float closest_y = y0 + t * dy - y;
+    return sqrtf(closest_x * closest_x + closest_y * closest_y);
+}
+
+void load_object_grid(void) {
+    object_grid.cells = arena_alloc(&level_arena, map_width * map_height * sizeof(object_grid.cells[0]));
+    for (int i = 0; i < map_width * map_height; i++) {
+        object_grid.cells[i] = -1;
+    }
+
+    for (int i = 0; i < num_objects; i++) {
+        object_grid_insert(i);
+    }
+}
+
+/* Split the map into rooms and connect them through the doors */
+void load_rooms(void) {
+    const int num_tiles = map_width * map_height;
+    rooms.tile_rooms = arena_alloc(&level_arena, num_tiles * sizeof(rooms.tile_rooms[0]));
+    for (int i = 0; i < num_tiles; i++) {
+        rooms.tile_rooms[i] = -1;
+    }
+
+    /* flood fill every open tile not in a room yet into a new room, the
+     * stack holds tiles here and is never deeper than the map */
+    int *stack = arena_alloc(&level_arena, num_tiles * sizeof(stack[0]));
+    rooms.num_rooms = 0;
+    for (int start = 0; start < num_tiles; start++) {
+        const Cell *start_cell = map_cell(start % map_width, start / map_width);
+        if (rooms.tile_rooms[start] >= 0 || (start_cell->flags & (CELL_SOLID | CELL_DOOR))) {
+            continue;
+        }
+
+        int room = rooms.num_rooms++;
+        int depth = 0;
+        stack[depth++] = start;
+        rooms.tile_rooms[start] = room;
+        while (depth > 0) {
+            int tile = stack[--depth];
+            int x = tile % map_width, y = tile / map_width;
+            const int neighbours[4][2] = {{x - 1, y}, {x + 1, y}, {x, y - 1}, {x, y + 1}};
+            for (int i = 0; i < 4; i++) {
+                int nx = neighbours[i][0], ny = neighbours[i][1];
+                if (nx < 0 || ny < 0 || nx >= map_width || ny >= map_height) {
+                    continue;
+                }
+                int next = ny * map_width + nx;
+                if (rooms.tile_rooms[next] >= 0 || (map_cell(nx, ny)->flags & (CELL_SOLID | CELL_DOOR))) {
+                    continue;
+                }
+                rooms.tile_rooms[next] = room;
+                stack[depth++] = next;
+            }
+        }
+    }
+
+    /* a door connects the tiles in front of and behind its plane */
+    rooms.portals = arena_alloc(&level_arena, SDL_max(level.num_doors, 1) * sizeof(rooms.portals[0]));
+    rooms.first_portal = arena_alloc(&level_arena, (rooms.num_rooms + 1) * sizeof(rooms.first_portal[0]));
+    memset(rooms.first_portal, 0, (rooms.num_rooms + 1) * sizeof(rooms.first_portal[0]));
+    for (int door = 0; door < level.num_doors; door++) {
+        int x = level.doors[door].x, y = level.doors[door].y;
+        bool is_horizontal = map_cell(x, y)->flags & CELL_HORIZONTAL;
+        const int sides[2][2] = {
+            {is_horizontal ? x : x - 1, is_horizontal ? y - 1 : y},
+            {is_horizontal ? x : x + 1, is_horizontal ? y + 1 : y}
+        };
+
+        Portal *portal = &rooms.portals[door];
+        portal->door = door;
+        for (int side = 0; side < 2; side++) {
+            int sx = sides[side][0], sy = sides[side][1];
+            bool is_on_map = sx >= 0 && sy >= 0 && sx < map_width && sy < map_height;
+            portal->rooms[side] = is_on_map ? rooms.tile_rooms[sy * map_width + sx] : -1;
+            if (portal->rooms[side] >= 0) {
+                rooms.first_portal[portal->rooms[side] + 1]++;
+            }
+        }
+    }
+
+    /* counts to offsets, then fill in the portals of every room */
+    for (int room = 0; room < rooms.num_rooms; room++) {
+        rooms.first_portal[room + 1] += rooms.first_portal[room];
+    }
+    int num_room_portals = rooms.first_portal[rooms.num_rooms];
+    rooms.room_portals = arena_alloc(&level_arena, SDL_max(num_room_portals, 1) * sizeof(rooms.room_portals[0]));
+    int *fill = stack;
+    memcpy(fill, rooms.first_portal, rooms.num_rooms * sizeof(fill[0]));
+    for (int door = 0; door < level.num_doors; door++) {
+        for (int side = 0; side < 2; side++) {
+            int room = rooms.portals[door].rooms[side];
+            if (room >= 0) {
+                rooms.room_portals[fill[room]++] = door;
+            }
+        }
+    }
+
+    rooms.is_visible = arena_alloc(&level_arena, SDL_max(rooms.num_rooms, 1) * sizeof(rooms.is_visible[0]));
+    rooms.stack = arena_alloc(&level_arena, SDL_max(rooms.num_rooms, 1) * sizeof(rooms.stack[0]));
+
+    fprintf(stderr, "Rooms: %d, portals: %d\n", rooms.num_rooms, level.num_doors);
+}
+
+/* Flood visibility from the room of the camera. The camera standing in a
+ * doorway sees the rooms on both sides, and anywhere else (e.g. clipping into
+ * a wall) it sees everything. */
+void update_room_visibility(void) {
+    if (rooms.num_rooms == 0) {
+        return;
+    }
+
+    memset(rooms.is_visible, 0, rooms.num_rooms * sizeof(rooms.is_visible[0]));
+    int depth = 0;
+
+    int x = SDL_clamp((int)floorf(camera.x), 0, map_width - 1);
+    int y = SDL_clamp((int)floorf(camera.y), 0, map_height - 1);
+    int room = rooms.tile_rooms[y * map_width + x];
+    const Cell *cell = map_cell(x, y);
+    if (room >= 0) {
+        rooms.stack[depth++] = room;
+        rooms.is_visible[room] = true;
+    } else if (cell->flags & CELL_DOOR) {
+        const Portal *portal = &rooms.portals[cell->door];
+        for (int side = 0; side < 2; side++) {
+            int side_room = portal->rooms[side];
+            if (side_room >= 0 && !rooms.is_visible[side_room]) {
+                rooms.stack[depth++] = side_room;
+                rooms.is_visible[side_room] = true;
+            }
+        }
+    } else {
+        memset(rooms.is_visible, true, rooms.num_rooms * sizeof(rooms.is_visible[0]));
+        return;
+    }
+
+    while (depth > 0) {
+        int room = rooms.stack[--depth];
+        for (int i = rooms.first_portal[room]; i < rooms.first_portal[room + 1]; i++) {
+            const Portal *portal = &rooms.portals[rooms.room_portals[i]];
+            int other = portal->rooms[0] == room ? portal->rooms[1] : portal->rooms[0];
+            if (other < 0 || rooms.is_visible[other]) {
+                continue;
+            }
+
+            const ObjectState *door = &objects.state[level.door_objects[portal->door]];
+            const MapDoor *door_tile = &level.doors[portal->door];
+            if (door->as.door.door_width >= 1.0f || !is_tile_in_view(door_tile->x, door_tile->y)) {
+                continue;
+            }
+
+            rooms.stack[depth++] = other;
+            rooms.is_visible[other] = true;
+        }
+    }
+}
+
+/* Whether the tile overlaps the field of view: it does not when all of its
+ * corners are behind the camera, or all are outside of the same side of the
+ * view */
+bool is_tile_in_view(int x, int y) {
+    bool is_behind = true, is_left = true, is_right = true;
+    for (int corner = 0; corner < 4; corner++) {
+        float dx = x + (corner & 1) - camera.x;
+        float dy = y + (corner >> 1) - camera.y;
+        float view_depth = dx * camera.direction.x + dy * camera.direction.y;
+        float view_offset = dy * camera.direction.x - dx * camera.direction.y;
+        float half_width = view_depth * camera.tan_half_fov;
+        is_behind = is_behind && view_depth <= 0.0f;
+        is_left = is_left && view_offset < -half_width;
+        is_right = is_right && view_offset > half_width;
+    }
+    return !(is_behind || is_left || is_right);
+}
+
+/* Objects outside of the rooms, i.e. in doorways or walls, always count as
+ * visible */
+bool is_object_room_visible(int object) {
+    int room = rooms.tile_rooms[objects.grid_cell[object]];
+    return room < 0 || rooms.is_visible[room];
+}
+
+void init_door(int object, int x, int y) {
+    /* doors are drawn by the ray caster, not as sprites */
+    init_object(object, OBJECT_DOOR, x + 0.5, y + 0.5, OBJECT_HITTABLE | OBJECT_HARMLESS, NULL);
+    objects.hit_distance[object] = 0.6f;
+    objects.state[object].as.door.is_open = false;
+    objects.state[object].as.door.is_opening = false;
+    objects.state[object].as.door.door_width = 1.0f;
+}
+
+void door_hit(int object) {
+    ObjectState *state = &objects.state[object];
+    if (!state->as.door.is_open || !state->as.door.is_opening) {
+        objects.flags[object] |= OBJECT_UPDATEABLE;
+        state->as.door.is_opening = true;
+
+        Mix_PlayChannel(-1, door_sound, 0);
+    }
+}
+
+void door_update(int object, float elapsed_time) {
+    ObjectState *state = &objects.state[object];
+    if (!state->as.door.is_opening) {
+        return;
+    }
+    float diff = elapsed_time * 0.002f;
+    state->as.door.door_width -= diff;
+    if (state->as.door.door_width <= 0.0f) {
+        state->as.door.is_open = true;
+        state->as.door.is_opening = false;
+        objects.flags[object] &= ~(OBJECT_UPDATEABLE | OBJECT_HITTABLE);
+        state->as.door.door_width = 0.0f;
+    }
+}
+
+int compare_objects_by_distance(const void *left, const void *right) {
+    float left_distance = ((const VisibleObject *)left)->distance_to_player;
+    float right_distance = ((const VisibleObject *)right)->distance_to_player;
+    return left_distance < right_distance ? 1 : -1;
+}
+
+int num_objects_visible = 0;
+
+/* Collect objects that are visible and qsort them based on distance, furthest
+ * first. This'll solve the sprite overlapping problem. Returns the number of
+ * objects collected into objects_visible. */
+int collect_visible_objects(void) {
+    update_room_visibility();
+
+    /* only look at the objects in the tiles around the field of view */
+    int num_nearby = query_objects_in_view(objects.nearby, num_objects);
+    if (cull_check) {
+        check_objects_in_view(objects.nearby, num_nearby);
+    }
+
+    int num_objects_visible = 0;
+    for (int i = 0; i < num_nearby; i++) {
+        int object = objects.nearby[i];
+        if (!(objects.flags[object] & OBJECT_VISIBLE) || !is_object_room_visible(object)) {
+            continue;
+        }
+
+        float dx, dy, view_depth, view_offset;
+        if (!is_object_in_view(object, &dx, &dy, &view_depth, &view_offset)) {
+            continue;
+        }
+
+        VisibleObject *visible = &objects_visible[num_objects_visible];
+        *visible = (VisibleObject){
+            .texture = objects.state[object].texture,
+            .view_depth = view_depth,
+            .view_offset = view_offset
+        };
+        if (is_object_occluded(visible)) {
+            continue;
+        }
+
+        /* Distance to player */
+        visible->distance_to_player = sqrtf(dx * dx + dy * dy);
+
+        num_objects_visible++;
+    }
+
+    /* Now, sort the array based on distance to the player */
+    qsort(objects_visible, num_objects_visible, sizeof(objects_visible[0]), compare_objects_by_distance);
+
+    return num_objects_visible;
+}
+
+void build_depth_blocks(void) {
+    for (int block = 0; block * DEPTH_BLOCK_WIDTH < view.width; block++) {
+        int col_start = block * DEPTH_BLOCK_WIDTH;
+        int col_end = SDL_min(col_start + DEPTH_BLOCK_WIDTH, view.width);
+        int shortest = line_height_buffer[col_start];
+        for (int col = col_start + 1; col < col_end; col++) {
+            shortest = SDL_min(shortest, line_height_buffer[col]);
+        }
+        depth_blocks[block] = shortest;
+    }
+}
+
+/* Whether an object projects to no columns, or only to columns where the
+ * walls are in front of it, judging by the coarse depth buffer. Objects that
+ * are only partly hidden are left for the per-column depth test. */
+bool is_object_occluded(const VisibleObject *object) {
+    int line_height, screen_x;
+    project_object(object, &line_height, &screen_x);
+    if (line_height <= 0) {
+        return true;
+    }
+
+    int left = screen_x - line_height / 2;
+    int col_start = SDL_max(left, 0);
+    int col_end = SDL_min(left + line_height, view.width);
+    if (col_start >= col_end) {
+        return true;
+    }
+
+    for (int block = col_start / DEPTH_BLOCK_WIDTH; block <= (col_end - 1) / DEPTH_BLOCK_WIDTH; block++) {
+        if (line_height >= depth_blocks[block]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Move the object into the camera space: offset from the camera, depth along
+ * the view direction and offset across it. Returns whether it is in the
+ * field of view, no further away than the ray casters look. */
+bool is_object_in_view(int object, float *dx, float *dy, float *view_depth, float *view_offset) {
+    float x = objects.prev_x[object] + (objects.x[object] - objects.prev_x[object]) * camera.alpha;
+    float y = objects.prev_y[object] + (objects.y[object] - objects.prev_y[object]) * camera.alpha;
+    *dx = x - camera.x;
+    *dy = y - camera.y;
+    *view_depth = *dx * camera.direction.x + *dy * camera.direction.y;
+    *view_offset = *dy * camera.direction.x - *dx * camera.direction.y;
+
+    return *view_depth > 0.0f && fabsf(*view_offset) <= *view_depth * camera.tan_half_fov &&
+        *dx * *dx + *dy * *dy <= MAX_DISTANCE * MAX_DISTANCE;
+}
+
+/* Report every object in the field of view that the object grid query
+ * missed. The query results are sorted by object. */
+void check_objects_in_view(const int *nearby, int num_nearby) {
+    for (int object = 0; object < num_objects; object++) {
+        float dx, dy, view_depth, view_offset;
+        if (!(objects.flags[object] & OBJECT_VISIBLE) ||
+            !is_object_in_view(object, &dx, &dy, &view_depth, &view_offset)) {
+            continue;
         }
 
-        /* Distance to player */
-        float distance_to_object = sqrtf(powf(objects[i].x - player.x, 2) + powf(objects[i].y - player.y, 2));
+        if (bsearch(&object, nearby, num_nearby, sizeof(nearby[0]), compare_objects_by_index) == NULL) {
+            fprintf(stderr, "Object %d at %f %f is in view but was not queried, camera at %f %f\n",
+                    object, camera.x + dx, camera.y + dy, camera.x, camera.y);
+        }
+    }
+}
 
-        objects_visible[num_objects_visible] = &objects[i];
-        objects_visible[num_objects_visible]->distance_to_player = distance_to_object;
-        objects_visible[num_objects_visible]->angle_to_player = relative_angle;
+/* Find the on-screen line height and horizontal center of a visible object */
+void project_object(const VisibleObject *object, int *line_height, int *screen_x) {
+    /* Object line height based on the depth, which is the distance to the
+     * player with the fisheye correction applied */
+    *line_height = (int)(view.height / object->view_depth);
 
-        num_objects_visible++;
-    }
+    /* Calculate the horizontal position of the enemy on the screen */
+    *screen_x = (int)((view.width / 2) + object->view_offset / object->view_depth * camera.projection);
+}
 
-    /* Now, sort the array based on distance to the player */
-    qsort(objects_visible, num_objects_visible, sizeof(Object *), compare_objects_by_distance);
+void render_sprites(void) {
+    profile_begin("collect_visible_objects");
+    int num_objects_visible = collect_visible_objects();
+    profile_end();
 
+    profile_begin("draw_sprites");
     /* Go through visible objects and draw them */
     for (int i = 0; i < num_objects_visible; i++) {
-        Object *object = objects_visible[i];
-
-        /* Object line height based on the distance to the player + fisheye correction */
-        float relative_angle = object->angle_to_player;
-        int line_height = (int)(WINDOW_HEIGHT / (object->distance_to_player * cosf(relative_angle)));
+        VisibleObject *object = &objects_visible[i];
+        Texture *texture = object->texture;
 
-        /* Calculate the horizontal position of the enemy on the screen */
-        int screen_x = (int)((WINDOW_WIDTH / 2) - tanf(object->angle_to_player) * (WINDOW_WIDTH / 2) / tanf(FOV / 2));
+        int line_height, screen_x;
+        project_object(object, &line_height, &screen_x);
 
         /* Calculate the size of the object */
-        const int object_size = (int)(line_height);
-
-        /* Render the texture column by column */
-        for (int col = 0; col < object_size; col++) {
-            /* find the current object column to check and make sure it doesn't
-             * go above the number of rays casted - this might cause a crash
-             * when standing right next to the objects */
-            int screen_col = screen_x - object_size / 2 + col;
-            if (screen_col < 0 || screen_col >= RAY_COUNT)
+        const int object_size = line_height;
+        if (object_size <= 0) {
+            continue;
+        }
+
+        /* Sprites are sampled as if they were TEXTURE_WIDTH x TEXTURE_HEIGHT,
+         * smaller textures end up in the top left corner of the sprite */
+        const float tex_width = SDL_min(texture->width, TEXTURE_WIDTH);
+        const float tex_height = SDL_min(texture->height, TEXTURE_HEIGHT);
+        const int left = screen_x - object_size / 2;
+        const float top = (view.height - object_size) / 2;
+        const float bottom = top + object_size * tex_height / TEXTURE_HEIGHT;
+        const float u_scale = (float)TEXTURE_WIDTH / object_size / texture->width;
+        const float u_right = tex_width / texture->width;
+        const float v_bottom = tex_height / texture->height;
+
+        /* Clip the sprite to the screen and to its texture columns, so the
+         * loop below is bounded by the screen width however close it is */
+        int col_start = SDL_max(left, 0);
+        int col_end = SDL_min(left + (int)ceilf(object_size * tex_width / TEXTURE_WIDTH), view.width);
+
+        /* One quad per run of columns in front of the walls, all of them
+         * go in the single draw call of the pass. Texture coordinates are
+         * relative, so any mip level fits them. */
+        Texture *level = &texture->levels[mip_level(texture, TEXTURE_HEIGHT, object_size)];
+        const LightLevel *light = light_level(HIT_NONE, object->distance_to_player);
+        int col = col_start;
+        while (col < col_end) {
+            while (col < col_end && line_height < line_height_buffer[col]) {
+                col++;
+            }
+            int run_start = col;
+            while (col < col_end && line_height >= line_height_buffer[col]) {
+                col++;
+            }
+            if (col == run_start) {
+                continue;
+            }
+
+            float u0 = (run_start - left) * u_scale;
+            float u1 = SDL_min((col - left) * u_scale, u_right);
+            batch_quad(level, (SDL_FRect){run_start, top, col - run_start, bottom - top},
+                       (SDL_FRect){u0, 0.0f, u1 - u0, v_bottom}, light->modulation);
+        }
+    }
+    flush_batch();
+    profile_end();
+}
+
+/* Software backend: same scene as render_walls, but rasterized into the
+ * framebuffer strip by strip */
+void render_walls_software(void) {
+    render_strips(render_wall_strip_software);
+    build_depth_blocks();
+}
+
+void render_wall_strip_software(int col_start, int col_end) {
+    profile_begin("wall_strip");
+
+    /* the rows covered by the wall of each column, [start, end) */
+    int wall_start[view.width];
+    int wall_end[view.width];
+
+    profile_begin("cast_rays");
+    cast_rays(col_start, col_end);
+    profile_end();
+
+    profile_begin("draw_walls");
+    for (int i = col_start; i < col_end; i++) {
+        RayHit *hit = &ray_hits[i];
+
+        /* Calculate the line height while correcting for the fisheye effect */
+        float corrected_distance = hit->distance * camera.column_cos[i];
+        int line_height = (int)(view.height / corrected_distance);
+
+        /* Save line height in a depth buffer to use in in sprite rendering */
+        line_height_buffer[i] = line_height;
+
+        draw_wall_column_software(i, line_height, wall_textures[hit->texture], hit->tex_offset,
+                                  light_level(hit->collision, hit->distance));
+
+        int top = (view.height - SDL_max(line_height, 0)) / 2;
+        wall_start[i] = SDL_max(top, 0);
+        wall_end[i] = SDL_min(top + SDL_max(line_height, 0), view.height);
+    }
+    profile_end();
+
+    profile_begin("draw_flats");
+    if (textured_flats) {
+        draw_flats_software(col_start, col_end, wall_start, wall_end);
+    } else {
+        fill_flats_software(col_start, col_end, wall_start, wall_end);
+    }
+    profile_end();
+
+    profile_end();
+}
+
+/* Cast the ceiling and the floor row by row: the setup of a row is done
+ * once, then every run of columns where the row is above or below the wall
+ * is filled in one go, so that no pixel is drawn twice. Ceiling rows come
+ * first, then floor rows, so the runs only test one side of the walls. */
+void draw_flats_software(int col_start, int col_end, const int *wall_start, const int *wall_end) {
+    for (int y = 0; y < view.height / 2; y++) {
+        FlatRow flat;
+        setup_flat_row(y, offsetof(Cell, ceiling), &flat);
+
+        Uint32 *row = &framebuffer[y * view.width];
+        int x = col_start;
+        while (x < col_end) {
+            for (; x < col_end && y >= wall_start[x]; x++) {
+            }
+            int run_start = x;
+            for (; x < col_end && y < wall_start[x]; x++) {
+            }
+            if (x > run_start) {
+                draw_flat_span(row, run_start, x, &flat);
+            }
+        }
+    }
+
+    for (int y = view.height / 2; y < view.height; y++) {
+        FlatRow flat;
+        setup_flat_row(y, offsetof(Cell, floor), &flat);
+
+        Uint32 *row = &framebuffer[y * view.width];
+        int x = col_start;
+        while (x < col_end) {
+            for (; x < col_end && y < wall_end[x]; x++) {
+            }
+            int run_start = x;
+            for (; x < col_end && y >= wall_end[x]; x++) {
+            }
+            if (x > run_start) {
+                draw_flat_span(row, run_start, x, &flat);
+            }
+        }
+    }
+}
+
+/* Everything about a flat row that does not depend on the column: a row is
+ * as far away as a wall reaching down or up to it would be, which fixes its
+ * mip level and light */
+void setup_flat_row(int y, int layer, FlatRow *flat) {
+    const float distance = view.height / 2 / fabsf(y + 0.5f - view.height / 2);
+    const int level = mip_level(flat_textures[0], TEXTURE_WIDTH, (int)(view.height / distance));
+    flat->light = light_level(HIT_NONE, distance);
+    flat->pixels = flat_texels.levels[level];
+    flat->shift = FLAT_TEXTURE_SHIFT - level;
+    flat->layer = layer;
+
+    /* the world space offset of the row point of column x from the point
+     * straight ahead is the side vector times distance and column tangent */
+    const Vector2 side = {-camera.direction.y, camera.direction.x};
+    const float scale = (float)(1 << flat->shift);
+    flat->u = (camera.x + camera.direction.x * distance) * scale;
+    flat->v = (camera.y + camera.direction.y * distance) * scale;
+    flat->du = side.x * distance * scale;
+    flat->dv = side.y * distance * scale;
+}
+
+/* Fill the ceiling and the floor around the walls with their fogged colors by
+ * row, without drawing over the walls. Rows above or below all the walls of
+ * the strip are filled in one go, only the rows in between test the walls of
+ * every column. */
+void fill_flats_software(int col_start, int col_end, const int *wall_start, const int *wall_end) {
+    int highest_start = view.height / 2;
+    int lowest_end = view.height / 2;
+    for (int x = col_start; x < col_end; x++) {
+        highest_start = SDL_min(highest_start, wall_start[x]);
+        lowest_end = SDL_max(lowest_end, wall_end[x]);
+    }
+
+    for (int y = 0; y < view.height; y++) {
+        const Uint32 color = lighting.row_colors[y];
+        Uint32 *row = &framebuffer[y * view.width];
+        if (y < highest_start || y >= lowest_end) {
+            for (int x = col_start; x < col_end; x++) {
+                row[x] = color;
+            }
+        } else if (y < view.height / 2) {
+            fill_flat_span(row, col_start, col_end, y, wall_start, false);
+        } else {
+            fill_flat_span(row, col_start, col_end, y, wall_end, true);
+        }
+    }
+}
+
+/* Fill the columns of row y that are above the walls starting at walls[x],
+ * or below the walls ending there for the floor */
+void fill_flat_span(Uint32 *row, int col_start, int col_end, int y, const int *walls, bool is_floor) {
+    int x = col_start;
+#ifdef HAVE_PACKET_RAYCASTER
+    if (raycaster != RAYCASTER_SCALAR) {
+        x = fill_flat_span_sse2(row, col_start, col_end, y, walls, is_floor);
+    }
+#endif
+    const Uint32 color = lighting.row_colors[y];
+    for (; x < col_end; x++) {
+        row[x] = (y < walls[x]) != is_floor ? color : row[x];
+    }
+}
+
+#ifdef HAVE_PACKET_RAYCASTER
+
+/* fill_flat_span for 4 columns at a time, blending the color into the row by
+ * the comparison with the walls. Returns the first column left over. */
+__attribute__((target("sse2")))
+int fill_flat_span_sse2(Uint32 *row, int col_start, int col_end, int y, const int *walls, bool is_floor) {
+    const __m128i color = _mm_set1_epi32(lighting.row_colors[y]);
+    const __m128i row_y = _mm_set1_epi32(y);
+    const __m128i flip = _mm_set1_epi32(is_floor ? -1 : 0);
+
+    int x = col_start;
+    for (; x + 4 <= col_end; x += 4) {
+        __m128i mask = _mm_xor_si128(_mm_cmplt_epi32(row_y, _mm_loadu_si128((const __m128i *)&walls[x])), flip);
+        __m128i pixels = _mm_loadu_si128((const __m128i *)&row[x]);
+        _mm_storeu_si128((__m128i *)&row[x], _mm_or_si128(_mm_and_si128(mask, color), _mm_andnot_si128(mask, pixels)));
+    }
+    return x;
+}
+
+#endif /* HAVE_PACKET_RAYCASTER */
+
+/* Fill columns [col_start, col_end) of a framebuffer row with the flat, using
+ * the gather kernel along with the AVX2 ray caster */
+void draw_flat_span(Uint32 *row, int col_start, int col_end, const FlatRow *flat) {
+#ifdef HAVE_PACKET_RAYCASTER
+    if (raycaster == RAYCASTER_AVX2) {
+        draw_flat_span_avx2(row, col_start, col_end, flat);
+        return;
+    }
+#endif
+    draw_flat_span_scalar(row, col_start, col_end, flat);
+}
+
+/* Texels are fetched from the texture of the tile they fall into, which is
+ * only looked up again when the span crosses into the next tile */
+void draw_flat_span_scalar(Uint32 *row, int col_start, int col_end, const FlatRow *flat) {
+    const int shift = flat->shift;
+    const int mask = (1 << shift) - 1;
+    const LightLevel *light = flat->light;
+
+    int tile_x = INT32_MIN;
+    int tile_y = INT32_MIN;
+    const Uint32 *pixels = NULL;
+    for (int x = col_start; x < col_end; x++) {
+        int u = (int)(flat->u + camera.column_tan[x] * flat->du);
+        int v = (int)(flat->v + camera.column_tan[x] * flat->dv);
+        if (u >> shift != tile_x || v >> shift != tile_y) {
+            tile_x = u >> shift;
+            tile_y = v >> shift;
+
+            /* rows right below walls may reach a bit into the wall tiles, up
+             * to the border ones */
+            const Uint8 *cell = (const Uint8 *)map_cell(SDL_clamp(tile_x, -1, map_width),
+                                                        SDL_clamp(tile_y, -1, map_height));
+            pixels = &flat->pixels[cell[flat->layer] << 2 * shift];
+        }
+
+        Uint32 texel = pixels[(u & mask) << shift | (v & mask)];
+        row[x] = 0xFF000000 |
+            light->channels[0][texel >> 16 & 0xFF] << 16 |
+            light->channels[1][texel >> 8 & 0xFF] << 8 |
+            light->channels[2][texel & 0xFF];
+    }
+}
+
+#ifdef HAVE_PACKET_RAYCASTER
+
+/* draw_flat_span_scalar for 8 columns at a time: the cells under the texels,
+ * the texels and their shades in the light tables are all gathered. The
+ * tables are read 4 bytes at a time, the last ones run into the modulation
+ * color of the light level, and only the low byte is kept. */
+__attribute__((target("avx2")))
+void draw_flat_span_avx2(Uint32 *row, int col_start, int col_end, const FlatRow *flat) {
+    const __m256 u = _mm256_set1_ps(flat->u);
+    const __m256 v = _mm256_set1_ps(flat->v);
+    const __m256 du = _mm256_set1_ps(flat->du);
+    const __m256 dv = _mm256_set1_ps(flat->dv);
+    const __m128i shift = _mm_cvtsi32_si128(flat->shift);
+    const __m128i texture_shift = _mm_cvtsi32_si128(2 * flat->shift);
+    const __m128i layer_shift = _mm_cvtsi32_si128(8 * flat->layer);
+    const __m256i mask = _mm256_set1_epi32((1 << flat->shift) - 1);
+    const __m256i byte = _mm256_set1_epi32(0xFF);
+    const __m256i first_tile = _mm256_set1_epi32(-1);
+    const __m256i last_tile_x = _mm256_set1_epi32(map_width);
+    const __m256i last_tile_y = _mm256_set1_epi32(map_height);
+    const __m256i stride = _mm256_set1_epi32(tile_grid.stride);
+    const LightLevel *light = flat->light;
+
+    int x = col_start;
+    for (; x + 8 <= col_end; x += 8) {
+        __m256 tan = _mm256_loadu_ps(&camera.column_tan[x]);
+        __m256i us = _mm256_cvttps_epi32(_mm256_add_ps(u, _mm256_mul_ps(tan, du)));
+        __m256i vs = _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_mul_ps(tan, dv)));
+
+        /* the flat texture of the cells, clamped as in the scalar kernel */
+        __m256i tiles_x = _mm256_min_epi32(_mm256_max_epi32(_mm256_sra_epi32(us, shift), first_tile), last_tile_x);
+        __m256i tiles_y = _mm256_min_epi32(_mm256_max_epi32(_mm256_sra_epi32(vs, shift), first_tile), last_tile_y);
+        __m256i cells = _mm256_add_epi32(_mm256_mullo_epi32(tiles_y, stride), tiles_x);
+        __m256i words = _mm256_i32gather_epi32((const int *)tile_grid.origin, cells, sizeof(Cell));
+        __m256i textures = _mm256_and_si256(_mm256_srl_epi32(words, layer_shift), byte);
+
+        __m256i texels = _mm256_i32gather_epi32((const int *)flat->pixels,
+                                                _mm256_or_si256(_mm256_sll_epi32(textures, texture_shift),
+                                                                _mm256_or_si256(_mm256_sll_epi32(_mm256_and_si256(us, mask), shift),
+                                                                                _mm256_and_si256(vs, mask))), 4);
+
+        __m256i r = _mm256_i32gather_epi32((const int *)light->channels[0],
+                                           _mm256_and_si256(_mm256_srli_epi32(texels, 16), byte), 1);
+        __m256i g = _mm256_i32gather_epi32((const int *)light->channels[1],
+                                           _mm256_and_si256(_mm256_srli_epi32(texels, 8), byte), 1);
+        __m256i b = _mm256_i32gather_epi32((const int *)light->channels[2],
+                                           _mm256_and_si256(texels, byte), 1);
+        __m256i color = _mm256_or_si256(_mm256_set1_epi32(0xFF000000),
+                                        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(r, byte), 16),
+                                                        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(g, byte), 8),
+                                                                        _mm256_and_si256(b, byte))));
+        _mm256_storeu_si256((__m256i *)&row[x], color);
+    }
+    draw_flat_span_scalar(row, x, col_end, flat);
+}
+
+#endif /* HAVE_PACKET_RAYCASTER */
+
+/* Scale a texture column into a framebuffer column, shading it through the
+ * tables of the given light */
+void draw_wall_column_software(int x, int line_height, Texture *texture, float tex_offset, const LightLevel *light) {
+    if (line_height <= 0) {
+        return;
+    }
+
+    texture = &texture->levels[mip_level(texture, texture->height, line_height)];
+
+    int tex_x = (int)(tex_offset * (float)texture->width);
+    tex_x = SDL_clamp(tex_x, 0, texture->width - 1);
+    const Uint32 *column = &texture->pixels[tex_x * texture->height];
+
+    int top = (view.height - line_height) / 2;
+    int y_start = SDL_max(top, 0);
+    int y_end = SDL_min(top + line_height, view.height);
+
+    /* 16.16 fixed point texel position, walking down the column */
+    const Uint32 tex_step = ((Uint32)texture->height << 16) / line_height;
+    const Uint32 tex_last = texture->height - 1;
+    Uint32 tex_pos = (y_start - top) * tex_step;
+
+    Uint32 *pixel = &framebuffer[y_start * view.width + x];
+    for (int y = y_start; y < y_end; y++, pixel += view.width) {
+        Uint32 texel = column[SDL_min(tex_pos >> 16, tex_last)];
+        tex_pos += tex_step;
+
+        *pixel = 0xFF000000 |
+            light->channels[0][texel >> 16 & 0xFF] << 16 |
+            light->channels[1][texel >> 8 & 0xFF] << 8 |
+            light->channels[2][texel & 0xFF];
+    }
+}
+
+/* The mip level to draw a texture with when the given number of texels of
+ * level 0 gets scaled to size pixels on screen: the smallest level that still
+ * has a texel for every pixel */
+int mip_level(const Texture *texture, int texels, int size) {
+    int level = 0;
+    while (level + 1 < texture->num_levels && (texels >> (level + 1)) >= size) {
+        level++;
+    }
+    return level;
+}
+
+/* Software backend: same as render_sprites, but blending sprite texels into
+ * the framebuffer. Objects are sorted once, then every strip draws the slices
+ * of all sprites that fall into its columns. */
+void render_sprites_software(void) {
+    profile_begin("collect_visible_objects");
+    num_objects_visible = collect_visible_objects();
+    profile_end();
+
+    render_strips(render_sprite_strip_software);
+}
+
+void render_sprite_strip_software(int col_start, int col_end) {
+    profile_begin("sprite_strip");
+    for (int i = 0; i < num_objects_visible; i++) {
+        VisibleObject *object = &objects_visible[i];
+        Texture *texture = object->texture;
+
+        int line_height, screen_x;
+        project_object(object, &line_height, &screen_x);
+
+        const int object_size = line_height;
+        if (object_size <= 0) {
+            continue;
+        }
+
+        /* Only walk the columns and rows that end up in the strip */
+        int left = screen_x - object_size / 2;
+        int sprite_col_start = SDL_max(left, col_start);
+        int sprite_col_end = SDL_min(left + object_size, col_end);
+
+        int top = (view.height - object_size) / 2;
+        int y_start = SDL_max(top, 0);
+        int y_end = SDL_min(top + object_size, view.height);
+
+        /* Just like the SDL backend, sample sprites as if they were
+         * TEXTURE_WIDTH x TEXTURE_HEIGHT, smaller textures end up in the top
+         * left corner of the sprite. Both shrink with the mip level. */
+        const int level = mip_level(texture, TEXTURE_HEIGHT, object_size);
+        const Texture *mip = &texture->levels[level];
+        const LightLevel *light = light_level(HIT_NONE, object->distance_to_player);
+        const Uint32 tex_step = ((Uint32)(TEXTURE_HEIGHT >> level) << 16) / object_size;
+
+        for (int screen_col = sprite_col_start; screen_col < sprite_col_end; screen_col++) {
+            /* depth test against the wall column */
+            if (line_height < line_height_buffer[screen_col])
                 continue;
 
-            /* see if the wall column for this ray is further away than object
-             * column. Ignore otherise.*/
-            int wall_line_height = line_height_buffer[screen_col];
-            if (line_height < wall_line_height)
+            int tex_x = ((screen_col - left) * TEXTURE_WIDTH / object_size) >> level;
+            if (tex_x >= mip->width)
                 continue;
+            const Uint32 *column = &mip->pixels[tex_x * mip->height];
+
+            /* 16.16 fixed point, see draw_wall_column_software */
+            Uint32 tex_pos = (y_start - top) * tex_step;
+
+            Uint32 *pixel = &framebuffer[y_start * view.width + screen_col];
+            for (int y = y_start; y < y_end; y++, pixel += view.width) {
+                Uint32 tex_y = tex_pos >> 16;
+                tex_pos += tex_step;
+                if (tex_y >= (Uint32)mip->height)
+                    break;
+
+                Uint32 texel = column[tex_y];
+                Uint32 alpha = texel >> 24;
+                if (alpha == 0) {
+                    continue;
+                }
+
+                texel = (texel & 0xFF000000) |
+                    light->channels[0][texel >> 16 & 0xFF] << 16 |
+                    light->channels[1][texel >> 8 & 0xFF] << 8 |
+                    light->channels[2][texel & 0xFF];
+
+                if (alpha == 255) {
+                    *pixel = texel;
+                    continue;
+                }
+
+                /* alpha blend the edges */
+                Uint32 rb = ((texel & 0x00FF00FF) * alpha + (*pixel & 0x00FF00FF) * (255 - alpha)) >> 8;
+                Uint32 g = ((texel & 0x0000FF00) * alpha + (*pixel & 0x0000FF00) * (255 - alpha)) >> 8;
+                *pixel = 0xFF000000 | (rb & 0x00FF00FF) | (g & 0x0000FF00);
+            }
+        }
+    }
+    profile_end();
+}
+
+/* Upload the software framebuffer with a single texture update and scale it
+ * up to the window */
+void render_framebuffer(void) {
+    SDL_UpdateTexture(framebuffer_texture, NULL, framebuffer, view.width * sizeof(framebuffer[0]));
+    SDL_RenderCopy(renderer, framebuffer_texture, NULL, NULL);
+}
+
+/* Switch the SDL backend back to drawing into the window and scale the view
+ * up to it */
+void present_view(void) {
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_RenderCopy(renderer, view.texture, NULL, NULL);
+}
+
+/* Run a strip renderer over all the columns, in parallel when there are
+ * workers. Returns once every strip is drawn. */
+void render_strips(render_strip_fn render_strip) {
+    if (render_pool.num_workers == 0) {
+        render_strip(0, view.width);
+        return;
+    }
 
-            /* Calculate the source and destination rectangles for the
-             * current column. Note that ceilf here is necessary to avoid
-             * zero-width rectangles */
-            SDL_Rect src_rect = {ceilf(col * (float)TEXTURE_WIDTH / object_size), 0, ceilf((float)TEXTURE_WIDTH / object_size), TEXTURE_HEIGHT};
-            SDL_Rect dest_rect = {(screen_x - object_size / 2) + col, (WINDOW_HEIGHT - object_size) / 2, 1, object_size};
+    render_pool.render_strip = render_strip;
+    render_pool.strip_width = (view.width + render_pool.num_strips - 1) / render_pool.num_strips;
+    SDL_AtomicSet(&render_pool.next_strip, 0);
 
-            /* Render the current column of the texture */
-            SDL_RenderCopyEx(renderer, object->texture, &src_rect, &dest_rect, 0, NULL, SDL_FLIP_NONE);
+    for (int i = 0; i < render_pool.num_workers; i++) {
+        SDL_SemPost(render_pool.start[i]);
+    }
+
+    render_pool_run_strips();
+
+    for (int i = 0; i < render_pool.num_workers; i++) {
+        SDL_SemWait(render_pool.done);
+    }
+}
+
+void render_pool_run_strips(void) {
+    int strip;
+    while ((strip = SDL_AtomicAdd(&render_pool.next_strip, 1)) < render_pool.num_strips) {
+        int col_start = strip * render_pool.strip_width;
+        int col_end = SDL_min(col_start + render_pool.strip_width, view.width);
+        render_pool.render_strip(col_start, col_end);
+    }
+}
+
+int render_pool_worker(void *data) {
+    int worker = (int)(intptr_t)data;
+    SDL_sem *start = render_pool.start[worker];
+    profile_thread = worker + 1;
+    while (true) {
+        SDL_SemWait(start);
+        if (render_pool.is_quitting) {
+            break;
         }
+
+        render_pool_run_strips();
+        SDL_SemPost(render_pool.done);
     }
+    return 0;
 }
 
 void render_ui(void) {
@@ -992,177 +4128,537 @@ void render_ui(void) {
     snprintf(coin_str, sizeof(coin_str), "Coins: %d", coins_collected);
     snprintf(todo_str, sizeof(coin_str), "To do: %d", todo_left);
 
-    // Create a surface from the font and string
-    SDL_Color font_color = {0, 0, 0, 255}; // White text
-    SDL_Surface *coin_text_surface = TTF_RenderText_Solid(font, coin_str, font_color);
-    SDL_Surface *todo_text_surface = TTF_RenderText_Solid(font, todo_str, font_color);
+    // Only lays the strings out again when the counters change
+    set_text(&coin_text, coin_str);
+    set_text(&todo_text, todo_str);
 
-    // Create a texture from the surface
-    SDL_Texture *coin_text_texture = SDL_CreateTextureFromSurface(renderer, coin_text_surface);
-    SDL_Texture *todo_text_texture = SDL_CreateTextureFromSurface(renderer, todo_text_surface);
-
-    // Set the destination rectangle for the texture
-    SDL_Rect coin_dest_rect = {WINDOW_WIDTH - coin_text_surface->w - 10, 10, coin_text_surface->w, coin_text_surface->h};
-    SDL_Rect todo_dest_rect = {10, 10, todo_text_surface->w, todo_text_surface->h};
-
-    // Render the text texture
-    SDL_RenderCopy(renderer, coin_text_texture, NULL, &coin_dest_rect);
-    SDL_RenderCopy(renderer, todo_text_texture, NULL, &todo_dest_rect);
-
-    // Clean up
-    SDL_FreeSurface(coin_text_surface);
-    SDL_FreeSurface(todo_text_surface);
-    SDL_DestroyTexture(coin_text_texture);
-    SDL_DestroyTexture(todo_text_texture);
+    SDL_Color font_color = {0, 0, 0, 255}; // Black text
+    draw_text(&coin_text, WINDOW_WIDTH - coin_text.width - 10, 10, font_color);
+    draw_text(&todo_text, 10, 10, font_color);
 }
 
 void fire_projectile(void) {
-    Object *projectile = &objects[0];
-    if (projectile->is_visible)
+    const int projectile = 0;
+    if (objects.flags[projectile] & OBJECT_VISIBLE)
         return;
-    projectile->direction = (Vector2){cosf(player.direction), sinf(player.direction)};
-    projectile->x = player.x;
-    projectile->y = player.y;
-    projectile->is_visible = true;
-    projectile->is_updateable = true;
+    objects.state[projectile].direction = (Vector2){cosf(player.direction), sinf(player.direction)};
+    move_object(projectile, player.x, player.y);
+    objects.prev_x[projectile] = player.x;
+    objects.prev_y[projectile] = player.y;
+    objects.flags[projectile] |= OBJECT_VISIBLE | OBJECT_UPDATEABLE;
 }
 
+/* Load either a text map or a compiled one, and create the objects on it */
 void load_maps(const char *filename) {
+    if (is_compiled_map(filename)) {
+        load_compiled_map(filename);
+    } else {
+        load_text_map(filename);
+    }
+
+    spawn_map_objects(filename);
+    load_object_grid();
+    load_rooms();
+    build_light_tables();
+}
+
+bool is_valid_fog(const MapFog *fog) {
+    return fog->end == 0.0f || (fog->start >= 0.0f && fog->end > fog->start);
+}
+
+/* Allocate the tile grid for the map size, all cells start out as the solid
+ * border and get overwritten by the tiles of the map */
+void load_tile_grid(void) {
+    tile_grid.stride = map_width + 2;
+    tile_grid.cells = arena_alloc(&level_arena, tile_grid.stride * (map_height + 2) * sizeof(tile_grid.cells[0]));
+    tile_grid.origin = &tile_grid.cells[tile_grid.stride + 1];
+    for (int i = 0; i < tile_grid.stride * (map_height + 2); i++) {
+        tile_grid.cells[i] = (Cell){
+            .flags = CELL_SOLID, .texture = WALL_TEXTURE_WALL,
+            .floor = FLAT_TEXTURE_FLOOR, .ceiling = FLAT_TEXTURE_CEILING, .door = -1
+        };
+    }
+}
+
+/* Parse the text map, the authoring format, into the level arena */
+void load_text_map(const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         fprintf(stderr, "Error opening map file: %s\n", filename);
         exit(1);
     }
 
-    fscanf(file, "%d %d\n", &map_width, &map_height);
+    /* "width height", optionally followed by "fog r g b start end" */
+    char header[256];
+    if (fgets(header, sizeof(header), file) == NULL ||
+        sscanf(header, "%d %d", &map_width, &map_height) != 2 ||
+        map_width <= 0 || map_height <= 0 || map_width >= MAP_MAX_SIDE || map_height >= MAP_MAX_SIDE) {
+        fprintf(stderr, "Invalid map dimensions in the map file: %s\n", filename);
+        exit(1);
+    }
+
+    char keyword[16];
+    unsigned int fog_r, fog_g, fog_b;
+    int num_fields = sscanf(header, "%*d %*d %15s %u %u %u %f %f", keyword,
+                            &fog_r, &fog_g, &fog_b, &level.fog.start, &level.fog.end);
+    if (num_fields > 0) {
+        if (num_fields != 6 || strcmp(keyword, "fog") != 0 || fog_r > 255 || fog_g > 255 || fog_b > 255 ||
+            !is_valid_fog(&level.fog)) {
+            fprintf(stderr, "Invalid fog in the map file: %s\n", filename);
+            exit(1);
+        }
+        level.fog.color[0] = fog_r;
+        level.fog.color[1] = fog_g;
+        level.fog.color[2] = fog_b;
+    }
+
+    load_tile_grid();
+
+    /* the tiles are read in full first, the door table and the spawn list
+     * are sized by counting them */
+    const int row_size = map_width + 2; /* width + newline + null */
+    char *tiles = arena_alloc(&level_arena, map_height * row_size * sizeof(tiles[0]));
+
+    /* walk through all map cells, load the map and count the objects */
+    fprintf(stderr, "File: %s\n", filename);
+    fprintf(stderr, "Dimensions: %d x %d\n", map_width, map_height);
+
+    for (int y = 0; y < map_height; y++) {
+        char *row = &tiles[y * row_size];
+        if (fgets(row, row_size, file) == NULL) {
+            row[0] = '\0';
+        }
+        /* short rows are padded with empty tiles */
+        for (int x = strlen(row); x < map_width; x++) {
+            row[x] = ' ';
+        }
+
+        for (int x = 0; x < map_width; x++) {
+            char c = row[x];
+            fprintf(stderr, "%c", c);
+
+            Cell *cell = map_cell(x, y);
+            *cell = (Cell){
+                .flags = 0, .texture = WALL_TEXTURE_WALL,
+                .floor = FLAT_TEXTURE_FLOOR, .ceiling = FLAT_TEXTURE_CEILING, .door = -1
+            };
+
+            switch (c) {
+            case '@':
+            case 'p':
+            case 'f':
+            case 'c':
+            case '*':
+                level.num_spawns++;
+                break;
+            case '-':
+            case '|':
+                cell->flags = CELL_DOOR | (c == '-' ? CELL_HORIZONTAL : 0);
+                cell->texture = WALL_TEXTURE_DOOR;
+                cell->door = level.num_doors++;
+                break;
+            case '2':
+            case '3':
+            case '4':
+                cell->flags = CELL_SOLID;
+                cell->texture = WALL_TEXTURE_WINDOW + (c - '2');
+                break;
+            default:
+                /* any other digit is a plain wall */
+                if (isdigit(c)) {
+                    cell->flags = CELL_SOLID;
+                }
+                continue;
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+
+    load_flat_layers(file, filename);
+    fclose(file);
+
+    level.doors = arena_alloc(&level_arena, level.num_doors * sizeof(level.doors[0]));
+    level.spawns = arena_alloc(&level_arena, level.num_spawns * sizeof(level.spawns[0]));
+
+    int door = 0;
+    int spawn = 0;
+    for (int y = 0; y < map_height; y++) {
+        for (int x = 0; x < map_width; x++) {
+            char c = tiles[y * row_size + x];
+            if (map_cell(x, y)->flags & CELL_DOOR) {
+                level.doors[door++] = (MapDoor){x, y};
+            } else if (c != '\0' && strchr("@pfc*", c)) {
+                level.spawns[spawn++] = (MapSpawn){.x = x, .y = y, .type = c};
+            }
+        }
+    }
+}
+
+/* The tiles of a text map may be followed by flat layers: a "floor" or
+ * "ceiling" line, then a row per map row where a digit picks the flat texture
+ * of the tile and anything else keeps the default one */
+void load_flat_layers(FILE *file, const char *filename) {
+    const int row_size = SDL_max(map_width + 2, 16);
+    char *row = arena_alloc(&level_arena, row_size * sizeof(row[0]));
+
+    while (fgets(row, row_size, file) != NULL) {
+        row[strcspn(row, "\r\n")] = '\0';
+        if (row[0] == '\0') {
+            continue;
+        }
+
+        bool is_floor = strcmp(row, "floor") == 0;
+        if (!is_floor && strcmp(row, "ceiling") != 0) {
+            fprintf(stderr, "Unknown map layer '%s' in the map file: %s\n", row, filename);
+            exit(1);
+        }
+
+        for (int y = 0; y < map_height; y++) {
+            if (fgets(row, row_size, file) == NULL) {
+                row[0] = '\0';
+            }
+
+            for (int x = 0; x < map_width && row[x] != '\0' && row[x] != '\n'; x++) {
+                if (!isdigit(row[x])) {
+                    continue;
+                }
+
+                int texture = row[x] - '0';
+                if (texture >= FLAT_TEXTURE_COUNT) {
+                    fprintf(stderr, "Unknown flat texture '%c' in the map file: %s\n", row[x], filename);
+                    exit(1);
+                }
+
+                Cell *cell = map_cell(x, y);
+                if (is_floor) {
+                    cell->floor = texture;
+                } else {
+                    cell->ceiling = texture;
+                }
+            }
+        }
+    }
+}
+
+/* Compiled maps are told apart from text ones by the magic */
+bool is_compiled_map(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening map file: %s\n", filename);
+        exit(1);
+    }
+
+    char magic[sizeof(((MapHeader *)0)->magic)];
+    bool is_compiled = fread(magic, sizeof(magic), 1, file) == 1 &&
+        memcmp(magic, MAP_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return is_compiled;
+}
+
+/* Map the compiled map into memory and use its sections in place: loading
+ * only makes one pass over the cells to range check them, nothing is copied
+ * or parsed */
+void load_compiled_map(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0) {
+        fprintf(stderr, "Error opening map file: %s\n", filename);
+        exit(1);
+    }
+
+    if ((size_t)file_stat.st_size < sizeof(MapHeader)) {
+        fprintf(stderr, "Truncated compiled map file: %s\n", filename);
+        exit(1);
+    }
+
+    /* the tile grid is never written to, a read-only private mapping is
+     * enough */
+    void *data = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error mapping map file: %s\n", filename);
+        exit(1);
+    }
+    level.mapping = data;
+    level.mapping_size = file_stat.st_size;
+
+    const MapHeader *header = data;
+    if (header->version != MAP_VERSION || header->byte_order != MAP_BYTE_ORDER) {
+        fprintf(stderr, "Unsupported compiled map version or byte order: %s\n", filename);
+        exit(1);
+    }
+
+    /* all section bounds and cells are checked here, the checksum only on
+     * request; doors and spawns get checked as they are spawned */
+    Uint64 cells_size = (Uint64)(header->width + 2) * (header->height + 2) * sizeof(Cell);
+    Uint64 doors_size = (Uint64)header->num_doors * sizeof(MapDoor);
+    Uint64 spawns_size = (Uint64)header->num_spawns * sizeof(MapSpawn);
+    if (header->width <= 0 || header->height <= 0 ||
+        header->width >= MAP_MAX_SIDE || header->height >= MAP_MAX_SIDE ||
+        header->num_doors > INT32_MAX || header->num_spawns > INT32_MAX || !is_valid_fog(&header->fog) ||
+        header->file_size != level.mapping_size ||
+        header->cells_offset % 8 || header->doors_offset % 8 || header->spawns_offset % 8 ||
+        header->cells_offset < sizeof(MapHeader) || header->cells_offset + cells_size > header->file_size ||
+        header->doors_offset < sizeof(MapHeader) || header->doors_offset + doors_size > header->file_size ||
+        header->spawns_offset < sizeof(MapHeader) || header->spawns_offset + spawns_size > header->file_size) {
+        fprintf(stderr, "Corrupted compiled map file: %s\n", filename);
+        exit(1);
+    }
+
+    if (map_check) {
+        check_compiled_map(filename, header);
+    }
+    check_compiled_cells(filename, header);
+
+    map_width = header->width;
+    map_height = header->height;
+    tile_grid.stride = map_width + 2;
+    tile_grid.cells = (Cell *)((char *)data + header->cells_offset);
+    tile_grid.origin = &tile_grid.cells[tile_grid.stride + 1];
+    level.doors = (MapDoor *)((char *)data + header->doors_offset);
+    level.num_doors = header->num_doors;
+    level.spawns = (MapSpawn *)((char *)data + header->spawns_offset);
+    level.num_spawns = header->num_spawns;
+    level.fog = header->fog;
+
+    fprintf(stderr, "File: %s (compiled)\n", filename);
+    fprintf(stderr, "Dimensions: %d x %d\n", map_width, map_height);
+}
+
+/* Hash the whole compiled map and compare against the stored checksum */
+void check_compiled_map(const char *filename, const MapHeader *header) {
+    const char *data = (const char *)header;
+    if (map_checksum(data + sizeof(MapHeader), header->file_size - sizeof(MapHeader)) != header->checksum) {
+        fprintf(stderr, "Checksum mismatch in compiled map file: %s\n", filename);
+        exit(1);
+    }
+}
+
+/* Range check every cell, so that a bad file can not make the ray caster or
+ * the renderers index out of bounds: a single pass over the grid, much
+ * cheaper than the checksum */
+void check_compiled_cells(const char *filename, const MapHeader *header) {
+    const char *data = (const char *)header;
+    const Cell *cells = (const Cell *)(data + header->cells_offset);
+    int stride = header->width + 2;
+    for (int y = 0; y < header->height + 2; y++) {
+        for (int x = 0; x < stride; x++) {
+            const Cell *cell = &cells[y * stride + x];
+            bool is_border = x == 0 || y == 0 || x == stride - 1 || y == header->height + 1;
+            bool is_door = cell->flags & CELL_DOOR;
+            if (cell->flags & ~(CELL_SOLID | CELL_DOOR | CELL_HORIZONTAL) ||
+                cell->texture >= WALL_TEXTURE_COUNT ||
+                cell->floor >= FLAT_TEXTURE_COUNT || cell->ceiling >= FLAT_TEXTURE_COUNT ||
+                (is_border && !(cell->flags & CELL_SOLID)) ||
+                (is_door && (cell->flags & CELL_SOLID)) ||
+                (is_door && (cell->door < 0 || (Uint32)cell->door >= header->num_doors))) {
+                fprintf(stderr, "Invalid cell %d, %d in compiled map file: %s\n", x - 1, y - 1, filename);
+                exit(1);
+            }
+        }
+    }
+}
+
+/* 64 bit FNV-1a */
+Uint64 map_checksum(const void *data, size_t size) {
+    return hash_bytes(0xcbf29ce484222325ULL, data, size);
+}
 
-    map = malloc(map_height * sizeof(map[0]));
-    door_map = calloc(map_height * sizeof(door_map[0]), 1);
+/* Continue an FNV-1a hash over more data */
+Uint64 hash_bytes(Uint64 hash, const void *data, size_t size) {
+    const Uint8 *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
 
+/* Create the objects of the level. Doors and other objects come from two
+ * lists, they are merged so that objects get created in map order. */
+void spawn_map_objects(const char *filename) {
     /* the first object is always the projectile */
-    init_projectile(&objects[0]);
-    num_objects++;
+    init_projectile(create_object());
+
+    level.door_objects = arena_alloc(&level_arena, level.num_doors * sizeof(level.door_objects[0]));
 
     /* need to make sure the player was there */
     bool player_start_found = false;
 
-    /* walk through all map cells, load the map and all the objects*/
-    fprintf(stderr, "File: %s\n", filename);
-    fprintf(stderr, "Dimensions: %d x %d\n", map_width, map_height);
+    int door = 0;
+    for (int spawn = 0; spawn <= level.num_spawns; spawn++) {
+        const MapSpawn *s = &level.spawns[spawn];
+        Sint64 position = spawn < level.num_spawns ? (Sint64)s->y * map_width + s->x : INT64_MAX;
+
+        for (; door < level.num_doors && (Sint64)level.doors[door].y * map_width + level.doors[door].x < position; door++) {
+            const MapDoor *d = &level.doors[door];
+            if (d->x < 0 || d->x >= map_width || d->y < 0 || d->y >= map_height ||
+                !(map_cell(d->x, d->y)->flags & CELL_DOOR) || map_cell(d->x, d->y)->door != door) {
+                fprintf(stderr, "Invalid door %d in the map file: %s\n", door, filename);
+                exit(1);
+            }
+            level.door_objects[door] = create_object();
+            init_door(level.door_objects[door], d->x, d->y);
+        }
 
-    for (int y = 0; y < map_height; y++) {
-        /* size = width + newline + null */
-        map[y] = malloc(map_width * sizeof(map[y][0]) + 2);
-        door_map[y] = malloc(map_width * sizeof(door_map[y][0]));
-        fgets(map[y], map_width * sizeof(char) + 2, file);
-        for (int x = 0; x < map_width; x++) {
-            char c = map[y][x];
-            fprintf(stderr, "%c", c);
+        if (spawn == level.num_spawns) {
+            break;
+        }
 
-            switch (c) {
-            case '@':
-                player.x = x + 0.5;
-                player.y = y + 0.5;
-                map[y][x] = ' ';
-                player_start_found = true;
-                break;
-            case 'p':
-                if (num_objects >= MAX_OBJECTS) {
-                    goto too_many_objects;
-                }
-                init_poo(&objects[num_objects], x, y);
-                num_objects++;
-                map[y][x] = ' ';
-                break;
-            case 'f':
-                if (num_objects >= MAX_OBJECTS) {
-                    goto too_many_objects;
-                }
-                init_fly(&objects[num_objects], x, y);
-                num_objects++;
-                map[y][x] = ' ';
-                break;
-            case 'c':
-                if (num_objects >= MAX_OBJECTS) {
-                    goto too_many_objects;
-                }
-                init_coin(&objects[num_objects], x, y);
-                num_objects++;
-                map[y][x] = ' ';
-                break;
-            case '*':
-                if (num_objects >= MAX_OBJECTS) {
-                    goto too_many_objects;
-                }
-                init_flower(&objects[num_objects], x, y);
-                num_objects++;
-                map[y][x] = ' ';
-                break;
-            case '-':
-            case '|':
-                init_door(&objects[num_objects], x, y);
-                door_map[y][x] = &objects[num_objects];
-                num_objects++;
-                break;
-            default:
-                continue;
-            }
+        if (s->x < 0 || s->x >= map_width || s->y < 0 || s->y >= map_height) {
+            fprintf(stderr, "Invalid object position in the map file: %s\n", filename);
+            exit(1);
+        }
+
+        switch (s->type) {
+        case '@':
+            player.x = s->x + 0.5;
+            player.y = s->y + 0.5;
+            player_start_found = true;
+            break;
+        case 'p':
+            init_poo(create_object(), s->x, s->y);
+            break;
+        case 'f':
+            init_fly(create_object(), s->x, s->y);
+            break;
+        case 'c':
+            init_coin(create_object(), s->x, s->y);
+            break;
+        case '*':
+            init_flower(create_object(), s->x, s->y);
+            break;
+        default:
+            fprintf(stderr, "Unknown object '%c' in the map file: %s\n", s->type, filename);
+            exit(1);
         }
-        fprintf(stderr, "\n");
     }
 
     if (!player_start_found) {
         fprintf(stderr, "No starting position found in the map file: %s\n", filename);
         exit(1);
     }
+}
+
+/* Write the text map as a compiled map: the header, then the sections as they
+ * are laid out in memory */
+void compile_map(const char *filename, const char *output_filename) {
+    load_text_map(filename);
+
+    MapHeader header = {
+        .magic = MAP_MAGIC,
+        .version = MAP_VERSION,
+        .byte_order = MAP_BYTE_ORDER,
+        .width = map_width,
+        .height = map_height,
+        .num_doors = level.num_doors,
+        .num_spawns = level.num_spawns,
+        .fog = level.fog,
+    };
+
+    size_t cells_size = (size_t)tile_grid.stride * (map_height + 2) * sizeof(Cell);
+    size_t doors_size = level.num_doors * sizeof(MapDoor);
+    size_t spawns_size = level.num_spawns * sizeof(MapSpawn);
+
+    header.cells_offset = sizeof(header);
+    header.doors_offset = (header.cells_offset + cells_size + 7) & ~7ULL;
+    header.spawns_offset = (header.doors_offset + doors_size + 7) & ~7ULL;
+    header.file_size = (header.spawns_offset + spawns_size + 7) & ~7ULL;
+
+    /* the payload is put together in memory for the checksum, padding is
+     * zeroed by the arena */
+    char *payload = arena_alloc(&level_arena, header.file_size - sizeof(header));
+    memcpy(payload + header.cells_offset - sizeof(header), tile_grid.cells, cells_size);
+    memcpy(payload + header.doors_offset - sizeof(header), level.doors, doors_size);
+    memcpy(payload + header.spawns_offset - sizeof(header), level.spawns, spawns_size);
+    header.checksum = map_checksum(payload, header.file_size - sizeof(header));
+
+    FILE *file = fopen(output_filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening compiled map file: %s\n", output_filename);
+        exit(1);
+    }
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+        fwrite(payload, header.file_size - sizeof(header), 1, file) != 1 ||
+        fclose(file) != 0) {
+        fprintf(stderr, "Error writing compiled map file: %s\n", output_filename);
+        exit(1);
+    }
 
-    fclose(file);
-    return;
+    fprintf(stderr, "Compiled %s into %s: %d x %d, %d doors, %d objects\n", filename, output_filename,
+            map_width, map_height, level.num_doors, level.num_spawns);
 
-too_many_objects:
-    fprintf(stderr, "No starting position found in the map file: %s\n", filename);
-    exit(1);
+    free_maps();
 }
 
+/* Release everything the level owns in one go */
 void free_maps(void) {
-    for (int y = 0; y < map_height; y++) {
-        free(map[y]);
-        free(door_map[y]);
+    arena_release(&level_arena);
+    if (level.mapping) {
+        munmap(level.mapping, level.mapping_size);
     }
-    free(map);
-    free(door_map);
+
+    level = (typeof(level)){0};
+    tile_grid.cells = NULL;
+    tile_grid.origin = NULL;
+    object_grid.cells = NULL;
+    rooms = (typeof(rooms)){0};
+    objects = (typeof(objects)){.free_list = -1};
+    objects_visible = NULL;
+    num_objects = 0;
 }
 
+/* Draw a one-off message with an outline: the outline color at the four
+ * diagonal offsets, then the text itself on top */
 void render_text(const char *message, SDL_Color color, SDL_Color outline_color, int x, int y) {
-    SDL_Surface *text_surface = TTF_RenderText_Blended(font, message, color);
-    SDL_Surface *outline_surface = TTF_RenderText_Blended(font, message, outline_color);
-
-    SDL_Rect offset;
-    offset.x = -1;
-    offset.y = -1;
-    SDL_BlitSurface(outline_surface, NULL, text_surface, &offset);
-    offset.x = 1;
-    offset.y = -1;
-    SDL_BlitSurface(outline_surface, NULL, text_surface, &offset);
-    offset.x = -1;
-    offset.y = 1;
-    SDL_BlitSurface(outline_surface, NULL, text_surface, &offset);
-    offset.x = 1;
-    offset.y = 1;
-    SDL_BlitSurface(outline_surface, NULL, text_surface, &offset);
-
-    SDL_Texture *text_texture = SDL_CreateTextureFromSurface(renderer, text_surface);
-
-    SDL_Rect dest;
-    dest.x = x;
-    dest.y = y;
-    dest.w = text_surface->w;
-    dest.h = text_surface->h;
-
-    SDL_RenderCopy(renderer, text_texture, NULL, &dest);
-    SDL_FreeSurface(text_surface);
-    SDL_FreeSurface(outline_surface);
-    SDL_DestroyTexture(text_texture);
+    Text text = {0};
+    set_text(&text, message);
+
+    draw_text(&text, x - 1, y - 1, outline_color);
+    draw_text(&text, x + 1, y - 1, outline_color);
+    draw_text(&text, x - 1, y + 1, outline_color);
+    draw_text(&text, x + 1, y + 1, outline_color);
+    draw_text(&text, x, y, color);
+}
+
+/* Lay the text out as glyph quads, unless it already shows the same string */
+void set_text(Text *text, const char *content) {
+    if (text->is_laid_out && strcmp(text->content, content) == 0) {
+        return;
+    }
+
+    snprintf(text->content, sizeof(text->content), "%s", content);
+    text->num_quads = 0;
+    text->width = 0;
+    text->height = glyph_atlas.height;
+
+    for (const char *c = text->content; *c; c++) {
+        unsigned char ch = *c;
+        if (ch < GLYPH_FIRST || ch > GLYPH_LAST) {
+            ch = '?';
+        }
+
+        Glyph *glyph = &glyph_atlas.glyphs[ch - GLYPH_FIRST];
+        if (glyph->rect.w > 0) {
+            text->src[text->num_quads] = glyph->rect;
+            text->dest[text->num_quads] = (SDL_Rect){text->width, 0, glyph->rect.w, glyph->rect.h};
+            text->num_quads++;
+        }
+        text->width += glyph->advance;
+    }
+
+    text->is_laid_out = true;
+}
+
+void draw_text(const Text *text, int x, int y, SDL_Color color) {
+    SDL_SetTextureColorMod(glyph_atlas.texture, color.r, color.g, color.b);
+    SDL_SetTextureAlphaMod(glyph_atlas.texture, color.a);
+
+    for (int i = 0; i < text->num_quads; i++) {
+        SDL_Rect dest = text->dest[i];
+        dest.x += x;
+        dest.y += y;
+        SDL_RenderCopy(renderer, glyph_atlas.texture, &text->src[i], &dest);
+    }
 }
 
 
@@ -1193,23 +4689,603 @@ void load_textures(void) {
             exit(1);
         }
 
-        SDL_Texture *texture = SDL_CreateTextureFromSurface(renderer, surface);
-        if (texture == NULL) {
-            fprintf(stderr, "Failed to load a texture: %s\n", IMG_GetError());
+        /* keep decoded texels around, transposed while copying them out of
+         * the surface */
+        SDL_Surface *converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+        if (converted == NULL) {
+            fprintf(stderr, "Failed to convert a surface: %s\n", SDL_GetError());
+            exit(1);
+        }
+
+        Texture *texture = name_to_texture_table[i].texture;
+        texture->width = converted->w;
+        texture->height = converted->h;
+        texture->pixels = malloc(converted->w * converted->h * sizeof(texture->pixels[0]));
+        if (texture->pixels == NULL) {
+            fprintf(stderr, "Failed to allocate texels for %s\n", name_to_texture_table[i].name);
             exit(1);
         }
 
-        *name_to_texture_table[i].texture = texture;
+        SDL_LockSurface(converted);
+        for (int y = 0; y < converted->h; y++) {
+            const Uint32 *row = (const Uint32 *)((Uint8 *)converted->pixels + y * converted->pitch);
+            for (int x = 0; x < converted->w; x++) {
+                texture->pixels[x * converted->h + y] = row[x];
+            }
+        }
+        SDL_UnlockSurface(converted);
 
+        SDL_FreeSurface(converted);
         SDL_FreeSurface(surface);
+
+        load_mip_levels(texture);
+    }
+
+    for (int i = 0; i < FLAT_TEXTURE_COUNT; i++) {
+        if (flat_textures[i]->width != TEXTURE_WIDTH || flat_textures[i]->height != TEXTURE_HEIGHT) {
+            fprintf(stderr, "Floor and ceiling textures must be %dx%d\n", TEXTURE_WIDTH, TEXTURE_HEIGHT);
+            exit(1);
+        }
+    }
+
+    load_flat_texels();
+    load_texture_atlas();
+}
+
+/* Copy the mip levels of the flat textures into flat_texels */
+void load_flat_texels(void) {
+    flat_texels.num_levels = flat_textures[0]->num_levels;
+    for (int level = 0; level < flat_texels.num_levels; level++) {
+        int side = TEXTURE_WIDTH >> level;
+        flat_texels.levels[level] = malloc(FLAT_TEXTURE_COUNT * side * side * sizeof(Uint32));
+        if (flat_texels.levels[level] == NULL) {
+            fprintf(stderr, "Failed to allocate the flat texels\n");
+            exit(1);
+        }
+        for (int i = 0; i < FLAT_TEXTURE_COUNT; i++) {
+            memcpy(&flat_texels.levels[level][i * side * side], flat_textures[i]->levels[level].pixels,
+                   side * side * sizeof(Uint32));
+        }
+    }
+}
+
+/* Build the mip chain of a loaded texture by averaging 2x2 blocks of texels
+ * of the previous level. Colors are weighted by alpha, so that transparent
+ * texels around sprites do not darken their edges. */
+void load_mip_levels(Texture *texture) {
+    texture->levels = calloc(MAX_MIP_LEVELS, sizeof(texture->levels[0]));
+    if (texture->levels == NULL) {
+        fprintf(stderr, "Failed to allocate mip levels\n");
+        exit(1);
+    }
+    texture->levels[0] = *texture;
+    texture->levels[0].levels = NULL;
+    texture->num_levels = 1;
+
+    while (texture->num_levels < MAX_MIP_LEVELS) {
+        const Texture *src = &texture->levels[texture->num_levels - 1];
+        if (src->width == 1 && src->height == 1) {
+            break;
+        }
+
+        Texture *dst = &texture->levels[texture->num_levels];
+        dst->width = SDL_max(src->width / 2, 1);
+        dst->height = SDL_max(src->height / 2, 1);
+        dst->pixels = malloc(dst->width * dst->height * sizeof(dst->pixels[0]));
+        if (dst->pixels == NULL) {
+            fprintf(stderr, "Failed to allocate mip levels\n");
+            exit(1);
+        }
+
+        for (int x = 0; x < dst->width; x++) {
+            for (int y = 0; y < dst->height; y++) {
+                Uint32 a = 0, r = 0, g = 0, b = 0;
+                for (int i = 0; i < 4; i++) {
+                    int src_x = SDL_min(x * 2 + (i & 1), src->width - 1);
+                    int src_y = SDL_min(y * 2 + (i >> 1), src->height - 1);
+                    Uint32 texel = src->pixels[src_x * src->height + src_y];
+                    Uint32 alpha = texel >> 24;
+                    a += alpha;
+                    r += (texel >> 16 & 0xFF) * alpha;
+                    g += (texel >> 8 & 0xFF) * alpha;
+                    b += (texel & 0xFF) * alpha;
+                }
+                Uint32 texel = 0;
+                if (a > 0) {
+                    texel = (a / 4) << 24 | (r / a) << 16 | (g / a) << 8 | (b / a);
+                }
+                dst->pixels[x * dst->height + y] = texel;
+            }
+        }
+
+        texture->num_levels++;
+    }
+}
+
+int compare_texture_heights(const void *a, const void *b) {
+    const Texture *texture_a = *(const Texture **)a;
+    const Texture *texture_b = *(const Texture **)b;
+    return texture_b->height - texture_a->height;
+}
+
+/* Pack all levels of the loaded textures into the atlas. Shelf packing: the
+ * levels go tallest first, left to right in rows as high as the first level
+ * of the row. Levels are separated by transparent padding, so that sampling
+ * one never picks texels of its neighbours. */
+void load_texture_atlas(void) {
+    const int num_textures = sizeof(name_to_texture_table) / sizeof(name_to_texture_table[0]);
+    Texture *levels[num_textures * MAX_MIP_LEVELS + 1];
+    SDL_Rect rects[num_textures * MAX_MIP_LEVELS + 1];
+    int num_levels = 0;
+    for (int i = 0; i < num_textures; i++) {
+        Texture *texture = name_to_texture_table[i].texture;
+        for (int level = 0; level < texture->num_levels; level++) {
+            levels[num_levels++] = &texture->levels[level];
+        }
+    }
+    qsort(levels, num_levels, sizeof(levels[0]), compare_texture_heights);
+
+    /* the white texel goes last, after the smallest levels */
+    int x = 0, y = 0;
+    int row_height = 0;
+    for (int i = 0; i <= num_levels; i++) {
+        int w = i < num_levels ? levels[i]->width : 1;
+        int h = i < num_levels ? levels[i]->height : 1;
+        if (x + w > TEXTURE_ATLAS_WIDTH) {
+            x = 0;
+            y += row_height + TEXTURE_ATLAS_PADDING;
+            row_height = 0;
+        }
+        rects[i] = (SDL_Rect){x, y, w, h};
+        x += w + TEXTURE_ATLAS_PADDING;
+        row_height = SDL_max(row_height, h);
+    }
+
+    const int height = y + row_height;
+    SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, TEXTURE_ATLAS_WIDTH, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (atlas == NULL) {
+        fprintf(stderr, "Failed to create the texture atlas: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    /* the renderer gets the levels row-major, like any other surface */
+    SDL_LockSurface(atlas);
+    for (int i = 0; i <= num_levels; i++) {
+        const SDL_Rect *rect = &rects[i];
+        SDL_FRect atlas_rect = {
+            (float)rect->x / TEXTURE_ATLAS_WIDTH, (float)rect->y / height,
+            (float)rect->w / TEXTURE_ATLAS_WIDTH, (float)rect->h / height
+        };
+        for (int ty = 0; ty < rect->h; ty++) {
+            Uint32 *row = (Uint32 *)((Uint8 *)atlas->pixels + (rect->y + ty) * atlas->pitch) + rect->x;
+            for (int tx = 0; tx < rect->w; tx++) {
+                row[tx] = i < num_levels ? levels[i]->pixels[tx * rect->h + ty] : 0xFFFFFFFF;
+            }
+        }
+
+        if (i < num_levels) {
+            levels[i]->atlas_rect = atlas_rect;
+        } else {
+            /* solid quads sample the middle of the white texel only */
+            texture_atlas.white = (SDL_FRect){atlas_rect.x + atlas_rect.w / 2, atlas_rect.y + atlas_rect.h / 2, 0, 0};
+        }
+    }
+    SDL_UnlockSurface(atlas);
+
+    /* the first level of each texture is the texture itself */
+    for (int i = 0; i < num_textures; i++) {
+        Texture *texture = name_to_texture_table[i].texture;
+        texture->atlas_rect = texture->levels[0].atlas_rect;
+    }
+
+    texture_atlas.texture = SDL_CreateTextureFromSurface(renderer, atlas);
+    SDL_FreeSurface(atlas);
+    if (texture_atlas.texture == NULL) {
+        fprintf(stderr, "Failed to create the texture atlas texture: %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetTextureBlendMode(texture_atlas.texture, SDL_BLENDMODE_BLEND);
+}
+
+/* Rasterize the printable ASCII glyphs of the font once, white on
+ * transparent, into a single texture; text color comes from color
+ * modulation */
+void load_glyph_atlas(void) {
+    SDL_Color white = {255, 255, 255, 255};
+    SDL_Surface *glyph_surfaces[GLYPH_COUNT] = {0};
+
+    /* shelf packing: glyphs go left to right in rows of the font height */
+    int x = 0, y = 0;
+    int row_height = 0;
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        Uint16 ch = GLYPH_FIRST + i;
+        Glyph *glyph = &glyph_atlas.glyphs[i];
+
+        int advance = 0;
+        if (TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL, &advance) < 0) {
+            continue;
+        }
+        glyph->advance = advance;
+
+        glyph_surfaces[i] = TTF_RenderGlyph_Blended(font, ch, white);
+        if (glyph_surfaces[i] == NULL) {
+            continue;
+        }
+
+        int w = glyph_surfaces[i]->w, h = glyph_surfaces[i]->h;
+        if (x + w > GLYPH_ATLAS_WIDTH) {
+            x = 0;
+            y += row_height;
+            row_height = 0;
+        }
+        glyph->rect = (SDL_Rect){x, y, w, h};
+        x += w;
+        row_height = SDL_max(row_height, h);
+        glyph_atlas.height = SDL_max(glyph_atlas.height, h);
+    }
+
+    SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, GLYPH_ATLAS_WIDTH, y + row_height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (atlas == NULL) {
+        fprintf(stderr, "Failed to create the glyph atlas: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        if (glyph_surfaces[i] == NULL) {
+            continue;
+        }
+
+        /* copy the glyph coverage as is instead of blending it */
+        SDL_SetSurfaceBlendMode(glyph_surfaces[i], SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(glyph_surfaces[i], NULL, atlas, &glyph_atlas.glyphs[i].rect);
+        SDL_FreeSurface(glyph_surfaces[i]);
+    }
+
+    glyph_atlas.texture = SDL_CreateTextureFromSurface(renderer, atlas);
+    SDL_FreeSurface(atlas);
+    if (glyph_atlas.texture == NULL) {
+        fprintf(stderr, "Failed to create the glyph atlas texture: %s\n", SDL_GetError());
+        exit(1);
+    }
+    SDL_SetTextureBlendMode(glyph_atlas.texture, SDL_BLENDMODE_BLEND);
+}
+
+void free_glyph_atlas(void) {
+    if (glyph_atlas.texture) {
+        SDL_DestroyTexture(glyph_atlas.texture);
+        glyph_atlas.texture = NULL;
     }
 }
 
 void free_textures(void) {
     /* iterate over the name_to_texture_table and destroy textures */
     for (int i = 0; i < sizeof(name_to_texture_table) / sizeof(name_to_texture_table[0]); i++) {
-        SDL_DestroyTexture(*name_to_texture_table[i].texture);
+        Texture *texture = name_to_texture_table[i].texture;
+        for (int level = 1; level < texture->num_levels; level++) {
+            free(texture->levels[level].pixels);
+        }
+        free(texture->levels);
+        free(texture->pixels);
+    }
+
+    for (int level = 0; level < flat_texels.num_levels; level++) {
+        free(flat_texels.levels[level]);
+    }
+    flat_texels.num_levels = 0;
+
+    if (texture_atlas.texture) {
+        SDL_DestroyTexture(texture_atlas.texture);
+        texture_atlas.texture = NULL;
+    }
+}
+
+/* Size the view for its scale and allocate everything that depends on the
+ * view size: the per-column buffers and camera tables, row colors and the
+ * framebuffer or the render target */
+void load_view(void) {
+    view.width = SDL_max((int)(WINDOW_WIDTH * view.scale), 1);
+    view.height = SDL_max((int)(WINDOW_HEIGHT * view.scale), 2);
+
+    line_height_buffer = calloc(view.width, sizeof(line_height_buffer[0]));
+    ray_hits = calloc(view.width, sizeof(ray_hits[0]));
+    camera.column_cos = calloc(view.width, sizeof(camera.column_cos[0]));
+    camera.column_sin = calloc(view.width, sizeof(camera.column_sin[0]));
+    camera.column_tan = calloc(view.width, sizeof(camera.column_tan[0]));
+    lighting.row_colors = calloc(view.height, sizeof(lighting.row_colors[0]));
+    depth_blocks = calloc((view.width + DEPTH_BLOCK_WIDTH - 1) / DEPTH_BLOCK_WIDTH, sizeof(depth_blocks[0]));
+    if (line_height_buffer == NULL || ray_hits == NULL || camera.column_cos == NULL || camera.column_sin == NULL ||
+        camera.column_tan == NULL || lighting.row_colors == NULL || depth_blocks == NULL) {
+        fprintf(stderr, "Failed to allocate the view buffers\n");
+        exit(1);
+    }
+
+    build_camera_tables();
+    build_row_colors();
+
+    if (render_backend == RENDER_BACKEND_SOFTWARE) {
+        framebuffer = malloc(view.width * view.height * sizeof(framebuffer[0]));
+        framebuffer_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                                view.width, view.height);
+        if (framebuffer == NULL || framebuffer_texture == NULL) {
+            fprintf(stderr, "Failed to create a framebuffer: %s\n", SDL_GetError());
+            exit(1);
+        }
+    } else {
+        view.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET,
+                                         view.width, view.height);
+        if (view.texture == NULL) {
+            fprintf(stderr, "Failed to create the view texture: %s\n", SDL_GetError());
+            exit(1);
+        }
+    }
+}
+
+void free_view(void) {
+    if (framebuffer_texture) {
+        SDL_DestroyTexture(framebuffer_texture);
+        framebuffer_texture = NULL;
+    }
+    if (view.texture) {
+        SDL_DestroyTexture(view.texture);
+        view.texture = NULL;
+    }
+    free(framebuffer);
+    free(line_height_buffer);
+    free(ray_hits);
+    free(camera.column_cos);
+    free(camera.column_sin);
+    free(camera.column_tan);
+    free(lighting.row_colors);
+    free(depth_blocks);
+    framebuffer = NULL;
+}
+
+/* Move the view scale a step towards the frame time budget, given the time
+ * the last frame took up to present. The average is compared against the
+ * budget: over it the scale goes down, and it goes up when the frame time
+ * predicted for the next step up (rendering costs about as much as there
+ * are pixels) would still fit in the budget with some room to spare. */
+void adjust_view_scale(float frame_time) {
+    view.frame_time = view.frame_time > 0.0f ? view.frame_time * 0.9f + frame_time * 0.1f : frame_time;
+    if (view.cooldown > 0) {
+        view.cooldown--;
+        return;
+    }
+
+    float scale = view.scale;
+    float step_up = (scale + VIEW_SCALE_STEP) / scale;
+    if (view.frame_time > view.budget) {
+        scale -= VIEW_SCALE_STEP;
+    } else if (view.frame_time * step_up * step_up < 0.9f * view.budget) {
+        scale += VIEW_SCALE_STEP;
+    }
+    scale = SDL_clamp(roundf(scale / VIEW_SCALE_STEP) * VIEW_SCALE_STEP, MIN_VIEW_SCALE, 1.0f);
+    if (scale == view.scale) {
+        return;
+    }
+
+    /* the average carries over, rescaled to the new number of pixels */
+    view.frame_time *= (scale * scale) / (view.scale * view.scale);
+    view.scale = scale;
+    view.cooldown = VIEW_SCALE_COOLDOWN;
+    free_view();
+    load_view();
+}
+
+void load_render_pool(void) {
+    /* the SDL renderer can only be used from the main thread */
+    if (render_backend != RENDER_BACKEND_SOFTWARE) {
+        return;
+    }
+
+    int num_threads = render_pool.num_threads > 0 ? render_pool.num_threads : SDL_GetCPUCount();
+    num_threads = SDL_clamp(num_threads, 1, MAX_RENDER_THREADS);
+
+    render_pool.num_workers = num_threads - 1;
+    render_pool.num_strips = num_threads * RENDER_STRIPS_PER_THREAD;
+    render_pool.done = SDL_CreateSemaphore(0);
+
+    for (int i = 0; i < render_pool.num_workers; i++) {
+        render_pool.start[i] = SDL_CreateSemaphore(0);
+        render_pool.workers[i] = SDL_CreateThread(render_pool_worker, "render", (void *)(intptr_t)i);
+        if (render_pool.workers[i] == NULL) {
+            fprintf(stderr, "Failed to create a render thread: %s\n", SDL_GetError());
+            exit(1);
+        }
+    }
+
+    fprintf(stderr, "Rendering with %d thread(s)\n", num_threads);
+}
+
+void load_profiler(void) {
+    if (!profiler.is_enabled) {
+        return;
+    }
+
+    profiler.num_threads = render_pool.num_workers + 1;
+    for (int i = 0; i < profiler.num_threads; i++) {
+        profiler.rings[i].zones = calloc(PROFILE_RING_SIZE, sizeof(ProfileZone));
+        if (profiler.rings[i].zones == NULL) {
+            fprintf(stderr, "Failed to allocate the profiler ring buffers\n");
+            exit(1);
+        }
+    }
+
+    SDL_Color label_color = {255, 255, 255, 255};
+    for (int i = 0; i < PROFILE_STAGE_COUNT; i++) {
+        SDL_Surface *surface = TTF_RenderText_Blended(font, profile_stages[i].name, label_color);
+        if (surface == NULL) {
+            continue;
+        }
+        profiler.stage_labels[i] = SDL_CreateTextureFromSurface(renderer, surface);
+        SDL_FreeSurface(surface);
+    }
+
+    profiler.start_time = SDL_GetPerformanceCounter();
+}
+
+void free_profiler(void) {
+    for (int i = 0; i < PROFILE_STAGE_COUNT; i++) {
+        if (profiler.stage_labels[i]) {
+            SDL_DestroyTexture(profiler.stage_labels[i]);
+        }
+    }
+    for (int i = 0; i < profiler.num_threads; i++) {
+        free(profiler.rings[i].zones);
+    }
+}
+
+void free_render_pool(void) {
+    render_pool.is_quitting = true;
+    for (int i = 0; i < render_pool.num_workers; i++) {
+        SDL_SemPost(render_pool.start[i]);
+        SDL_WaitThread(render_pool.workers[i], NULL);
+        SDL_DestroySemaphore(render_pool.start[i]);
+    }
+    render_pool.num_workers = 0;
+
+    if (render_pool.done) {
+        SDL_DestroySemaphore(render_pool.done);
+    }
+}
+
+void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--software") == 0) {
+            render_backend = RENDER_BACKEND_SOFTWARE;
+        } else if (strcmp(argv[i], "--textured-flats") == 0) {
+            textured_flats = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            render_pool.num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--raycaster") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            size_t r;
+            for (r = 0; r < SDL_arraysize(raycaster_names); r++) {
+                if (strcmp(name, raycaster_names[r]) == 0) {
+                    raycaster = r;
+                    break;
+                }
+            }
+            if (r == SDL_arraysize(raycaster_names)) {
+                fprintf(stderr, "Unknown ray caster: %s\n", name);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--raycaster-check") == 0) {
+            raycaster_check = true;
+        } else if (strcmp(argv[i], "--cull-check") == 0) {
+            cull_check = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profiler.is_enabled = true;
+            profiler.is_overlay_visible = true;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            profiler.is_enabled = true;
+            profiler.trace_filename = argv[++i];
+        } else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            map_filename = argv[++i];
+        } else if (strcmp(argv[i], "--compile-map") == 0 && i + 1 < argc) {
+            map_output_filename = argv[++i];
+        } else if (strcmp(argv[i], "--map-check") == 0) {
+            map_check = true;
+        } else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+            timing.tick_rate = atoi(argv[++i]);
+            if (timing.tick_rate <= 0) {
+                fprintf(stderr, "Bad tick rate: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--frame-rate") == 0 && i + 1 < argc) {
+            timing.frame_rate = atoi(argv[++i]);
+            if (timing.frame_rate <= 0) {
+                fprintf(stderr, "Bad frame rate: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            size_t p;
+            for (p = 0; p < SDL_arraysize(pacing_names); p++) {
+                if (strcmp(name, pacing_names[p]) == 0) {
+                    timing.pacing = p;
+                    break;
+                }
+            }
+            if (p == SDL_arraysize(pacing_names)) {
+                fprintf(stderr, "Unknown pacing: %s\n", name);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--view-scale") == 0 && i + 1 < argc) {
+            const char *scale = argv[++i];
+            if (strcmp(scale, "auto") == 0) {
+                view.is_auto = true;
+            } else {
+                view.scale = atof(scale);
+                if (view.scale < MIN_VIEW_SCALE || view.scale > 1.0f) {
+                    fprintf(stderr, "Bad view scale: %s\n", scale);
+                    exit(1);
+                }
+            }
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+            view.budget = atof(argv[++i]);
+            if (view.budget <= 0.0f) {
+                fprintf(stderr, "Bad frame budget: %s\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--input-latency") == 0) {
+            input.is_reported = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            rng.seed = strtoull(argv[++i], NULL, 10);
+            rng.is_seeded = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            replay.is_recording = true;
+            replay.filename = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay.is_replaying = true;
+            replay.filename = argv[++i];
+            bench.is_enabled = true;
+            bench.path_filename = replay.filename;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench.is_enabled = true;
+            bench.path_filename = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            fprintf(stderr, "Usage: %s [--software] [--textured-flats] [--threads N] [--raycaster auto|scalar|sse2|avx2] [--raycaster-check]\n"
+                    "          [--cull-check]\n"
+                    "          [--profile] [--trace FILE] [--map FILE] [--compile-map OUTPUT_FILE] [--map-check]\n"
+                    "          [--tick-rate HZ] [--frame-rate FPS] [--pacing sleep|vsync|none] [--input-latency]\n"
+                    "          [--view-scale SCALE|auto] [--frame-budget MS]\n"
+                    "          [--seed N] [--record FILE] [--replay FILE] [--bench CAMERA_PATH_FILE]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (replay.is_recording + replay.is_replaying + (bench.is_enabled && !replay.is_replaying) > 1) {
+        fprintf(stderr, "Only one of --record, --replay and --bench can be used at a time\n");
+        exit(1);
+    }
+}
+
+/* Pick the ray caster, falling back to narrower packets (or the scalar one)
+ * when the CPU does not support the requested instruction set */
+void init_raycaster(void) {
+#ifdef HAVE_PACKET_RAYCASTER
+    bool has_avx2 = SDL_HasAVX2();
+    bool has_sse2 = SDL_HasSSE2();
+#else
+    bool has_avx2 = false;
+    bool has_sse2 = false;
+#endif
+
+    if (raycaster == RAYCASTER_AUTO) {
+        raycaster = has_avx2 ? RAYCASTER_AVX2 : has_sse2 ? RAYCASTER_SSE2 : RAYCASTER_SCALAR;
+    }
+    if (raycaster == RAYCASTER_AVX2 && !has_avx2) {
+        fprintf(stderr, "AVX2 is not supported, falling back\n");
+        raycaster = has_sse2 ? RAYCASTER_SSE2 : RAYCASTER_SCALAR;
     }
+    if (raycaster == RAYCASTER_SSE2 && !has_sse2) {
+        fprintf(stderr, "SSE2 is not supported, falling back\n");
+        raycaster = RAYCASTER_SCALAR;
+    }
+
+    fprintf(stderr, "Casting rays with the %s ray caster\n", raycaster_names[raycaster]);
 }
 
 void load_sound(void) {